@@ -0,0 +1,293 @@
+/*
+shared by producent and konsument: what goes through the wire and code both sides need the same.
+Every program is one translation unit, so functions are defined here too
+*/
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE);} while (0)
+
+#define DATAPORTION 13312
+#define DATABLOCK 3328  // 13312 / 4 == 3328
+#define PROTOMAGIC 0x4b4f4e53   //"KONS", begins every header when size of portion is negotiated
+#define MAXSHARDS 16        //storage of producent has one shard for every generator
+#define UDPMAXRESEND 256    //block numbers in one resend request
+#define UDPCOOKIE 0xffffffffU   //index of datagramHeader: no block, blocks is cookie for next requests
+#define UDPREJECTED 0xfffffffeU //index of datagramHeader: no block, server is full
+
+//consumer model of konsument, simulation of producent follows the same
+#define MAGAZINE 30720          //bytes of magazine for every unit of -c
+#define DEGRADATION_TIME 819    //bytes of magazine lost in a second for every unit of -d
+#define CONSUMPTION_TIME 4435   //bytes consumed in a second for every unit of -p
+#define MAXCHOICES 16           //values of one 'c:' distribution
+
+#define MAXCPUS 64          //entries of -A lists
+
+//sent by client before every portion it wants, all fields in network byte order
+typedef struct requestHeader
+{
+    uint32_t magic;
+    uint32_t blocks;    //how many blocks of DATABLOCK client wants
+    uint32_t flags;
+    uint32_t deadlineMs;    //how long client can wait before its magazine degrades by a block, 0 - no limit
+}requestHeader;
+
+#define REQ_KEEPALIVE 1     //client sends next requestHeader on the same connection after its portion
+#define REQ_RESEND 2        //datagrams: blocks is count of uint32_t numbers of lost blocks which follow
+#define REQ_DONE 4          //datagrams: whole portion arrived, server can forget it; local: parts are copied out
+//datagrams: requestHeader is followed by cookie got from server, 0 before client has one, then resend list
+
+//datagrams: before every block
+typedef struct datagramHeader
+{
+    uint32_t magic;
+    uint32_t index;     //number of block in portion
+    uint32_t blocks;    //of whole portion
+}datagramHeader;
+
+//part of storage given to local client, start counts all bytes of shard like head and tail
+typedef struct localPart
+{
+    uint32_t shard;
+    uint32_t len;
+    uint64_t start;     //place is start % capacity
+}localPart;
+
+/*
+local clients get this instead of blocks, in host byte order; the first one on connection
+carries descriptors of all shards, client maps them and copies parts straight from storage
+*/
+typedef struct localGrant
+{
+    uint32_t magic;
+    uint32_t blocks;    //0 - rejected
+    uint32_t parts;
+    uint32_t shards;
+    uint64_t capacity;      //of every shard
+    uint64_t dataOffset;    //of ring data in mapping, whole descriptor is mapped
+    localPart part[MAXSHARDS];
+}localGrant;
+
+//sent by server before first block, number of blocks can be smaller than requested
+typedef struct grantHeader
+{
+    uint32_t magic;
+    uint32_t blocks;
+}grantHeader;
+
+#define GRANT_BROADCAST 0x80000000U     //in blocks of grant: blocks are numbered in stream, not in connection
+
+//value of -p/-d/-c, every simulated consumer draws its own
+typedef struct distribution
+{
+    char kind;      //'f' fixed, 'u' uniform from lo to hi, 'c' one of listed values
+    int count;
+    float values[MAXCHOICES];
+}distribution;
+
+float parseFloat(char* arr);
+void parseDistribution(char* arg, distribution* dist);
+float drawValue(distribution* dist);
+int compareSamples(const void* a, const void* b);
+
+//low latency profile
+int parseCpus(char* arg, int* cpus);
+void pinThread(pthread_t thread, int* cpus, int count, int index, const char* what);
+void lockMemory(void);
+void setBusyPoll(int* busyPoll, int fd);
+
+//integrity of blocks: producent seals them with CRC32C, konsument -I checks it
+void crc32cInit(void);
+uint32_t crc32cSoft(uint32_t crc, const unsigned char* p, size_t len);
+uint32_t crc32cHard(uint32_t crc, const unsigned char* p, size_t len);
+uint32_t crc32cTable[256];
+uint32_t (*crc32c)(uint32_t crc, const unsigned char* p, size_t len) = crc32cSoft;
+
+//instruction of SSE4.2 when processor has it, table otherwise
+void crc32cInit(void)
+{
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;     //reversed Castagnoli polynomial
+        crc32cTable[i] = c;
+    }
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("sse4.2"))
+        crc32c = crc32cHard;
+#endif
+}
+
+uint32_t crc32cSoft(uint32_t crc, const unsigned char* p, size_t len)
+{
+    while(len-- > 0)
+        crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cHard(uint32_t crc, const unsigned char* p, size_t len)
+{
+    uint64_t c = crc;
+    for(; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    while(len-- > 0)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#else
+uint32_t crc32cHard(uint32_t crc, const unsigned char* p, size_t len)
+{
+    return crc32cSoft(crc, p, len);
+}
+#endif
+
+float parseFloat(char* arr) 
+{
+    errno = 0;
+    char* eptr;
+    float val = strtof(arr, &eptr);
+    if(*eptr != '\0'|| errno == ERANGE ) 
+        errExit("strtof");
+    return val;
+}
+
+/*
+5         - always 5
+u:1:10    - uniform from 1 to 10
+c:1,1,4   - one of listed values, repeat value to make it more probable
+*/
+void parseDistribution(char* arg, distribution* dist)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", arg);     //simulation parses value again for every combination
+    memset(dist, 0, sizeof(distribution));
+    if(buf[0] == 'u' && buf[1] == ':')
+    {
+        char* hi = strchr(buf + 2, ':');
+        if(hi == NULL)
+            errExit("parseDistribution");
+        *hi = '\0';
+        dist->kind = 'u';
+        dist->values[0] = parseFloat(buf + 2);
+        dist->values[1] = parseFloat(hi + 1);
+        dist->count = 2;
+    }
+    else if(buf[0] == 'c' && buf[1] == ':')
+    {
+        dist->kind = 'c';
+        char* save;
+        for(char* v = strtok_r(buf + 2, ",", &save); v != NULL && dist->count < MAXCHOICES; v = strtok_r(NULL, ",", &save))
+            dist->values[dist->count++] = parseFloat(v);
+        if(dist->count == 0)
+            errExit("parseDistribution");
+    }
+    else
+    {
+        dist->kind = 'f';
+        dist->values[0] = parseFloat(buf);
+        dist->count = 1;
+    }
+}
+
+float drawValue(distribution* dist)
+{
+    if(dist->kind == 'u')
+        return dist->values[0] + (dist->values[1] - dist->values[0]) * drand48();
+    if(dist->kind == 'c')
+        return dist->values[lrand48() % dist->count];
+    return dist->values[0];
+}
+
+//for qsort of unsigned long samples
+int compareSamples(const void* a, const void* b)
+{
+    unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+    return x < y ? -1 : x > y;
+}
+
+//list like 1,3,8-11; returns number of CPUs
+int parseCpus(char* arg, int* cpus)
+{
+    int count = 0;
+    for(char* p = strtok(arg, ","); p != NULL; p = strtok(NULL, ","))
+    {
+        char* end;
+        long from = strtol(p, &end, 10);
+        long to = *end == '-' ? strtol(end + 1, &end, 10) : from;
+        if(*end != '\0' || from < 0 || to < from || to >= CPU_SETSIZE)
+        {
+            printf("wrong list of CPUs\n");
+            exit(EXIT_FAILURE);
+        }
+        for(long c = from; c <= to && count < MAXCPUS; c++)
+            cpus[count++] = c;
+    }
+    return count;
+}
+
+//list shorter than number of threads is used again from the beginning
+void pinThread(pthread_t thread, int* cpus, int count, int index, const char* what)
+{
+    if(count == 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % count], &set);
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if(err != 0)
+        fprintf(stderr, "%s %d can't be pinned to CPU %d: %s\n", what, index, cpus[index % count], strerror(err));
+}
+
+/*
+called after setup. Memory mapped later is locked only when limit can't be reached,
+otherwise every later mmap (stack of thread, grown buffer) would fail with EAGAIN.
+Without CAP_IPC_LOCK limit is usually too small, then it runs unlocked
+*/
+void lockMemory(void)
+{
+    static _Atomic int reported = 0;   //reactors of producent lock each after its own records
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_MEMLOCK, &rl) == -1)
+        errExit("getrlimit");
+    int flags = MCL_CURRENT;
+    if(rl.rlim_cur == RLIM_INFINITY || geteuid() == 0)
+        flags |= MCL_FUTURE;
+    if(mlockall(flags) == -1 && atomic_exchange(&reported, 1) == 0)
+        fprintf(stderr, "memory can't be locked: %s (limit %lu bytes)\n", strerror(errno), (unsigned long)rl.rlim_cur);
+}
+
+//values above net.core.busy_read need CAP_NET_ADMIN, then it is switched off
+void setBusyPoll(int* busyPoll, int fd)
+{
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, busyPoll, sizeof(*busyPoll)) == -1)
+    {
+        fprintf(stderr, "busy polling can't be set: %s\n", strerror(errno));
+        *busyPoll = 0;
+    }
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,16 +11,28 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include "common.h"
 
-#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE);} while (0)
-
-#define MAGAZINE 	30720
-#define DEGRADATION_TIME 819
-#define CONSUMPTION_TIME 4435
-#define DATAPORTION 13312
-#define DATABLOCK 3328
 #define TIMER_SIG SIGRTMAX
-
+#define MAXEVENTS 1024
+#define PIPEBLOCKS 16       //blocks received ahead of consumption in pipelined mode
+#define PIPEIDLE 100000     //ns, sleep of stage which has nothing to do
+#define UDPBATCH 64         //datagrams in one recvmmsg
+#define UDPREQUEST 1000     //ms, request is repeated so long no block came
+#define UDPRESEND 50        //ms, lost blocks are asked for after so long silence
+#define UDPRETRIES 40       //resend requests without answer before portion is given up
+#define UDPRCVBUF (4 << 20)
 
 typedef struct
 {
@@ -29,6 +42,58 @@ typedef struct
 
 }timesToReport;
 
+enum simState { SIM_CONNECTING, SIM_GRANT, SIM_RECEIVING, SIM_CONSUMING, SIM_DONE };
+
+//one consumer of load mode, does the same as operateOnData but without blocking
+typedef struct simConsumer
+{
+    int fd;
+    enum simState state;
+    float consumption;
+    float degradation;
+    int magazineCapacity;
+    int blocks;             //blocks of current portion not received yet
+    int blockOff;
+    char* block;            //with -I whole block is kept for checking
+    long seq;               //next expected number of block in connection, -1 - any
+    int grantOff;
+    char grant[sizeof(grantHeader)];
+    unsigned long connectUs;    //CLOCK_MONOTONIC
+    unsigned long firstUs;
+    unsigned long wakeAt;
+    int portions;
+}simConsumer;
+
+//deadline of consumer which is consuming a block
+typedef struct simTimer
+{
+    unsigned long at;
+    int id;
+}simTimer;
+
+typedef struct samples
+{
+    unsigned long* values;
+    int len;
+    int cap;
+}samples;
+
+/*
+received blocks waiting for consumption, one writer (receiving thread) and one reader (consuming thread);
+while it is empty the consumer has nothing to work on and magazine degrades
+*/
+typedef struct magazineRing
+{
+    _Atomic unsigned long head;         //blocks received
+    _Atomic unsigned long tail;         //blocks consumed
+    _Atomic int done;                   //receiver won't put more blocks
+    _Atomic long magazine;              //free bytes, consumer takes them by consuming and gives back what degrades
+    float consumption;
+    float degradation;
+    samples* jitter;    //oversleep of consumer thread, NULL without -j
+    char blocks[PIPEBLOCKS][DATABLOCK];
+}magazineRing;
+
 typedef struct datacontainer
 {
     int capacity;
@@ -41,6 +106,49 @@ typedef struct datacontainer
     timer_t timerId;
     int magazineCapacity;
     struct timespec ts;
+    int negotiate;      //ask server for as many blocks as magazine can take
+    int keepAlive;      //one connection for all portions, implies negotiate
+    int numOfConsumers;     //load mode when > 0
+    int pipelined;          //receiving and consuming in separate threads
+    int integrity;          //blocks carry sequence number and CRC32C, they are checked
+    int datagrams;          //portion comes over UDP, lost blocks are asked for again
+    char* portion;          //with datagrams whole portion is received before consumption
+    unsigned char* arrived; //blocks of portion which came already
+    int portionCap;         //blocks
+    uint32_t cookie;        //datagrams: proves to server that we get what it sends to our address
+    int local;              //address is Unix socket of producent, blocks are copied from its storage
+    char* shards[MAXSHARDS];    //storage of producent mapped read only
+    long seq;               //next expected number of block in connection, -1 - any
+    unsigned long verified;
+    unsigned long badChecksum;
+    unsigned long lostBlocks;   //numbers skipped in sequence
+    unsigned long reordered;    //number lower than expected
+    magazineRing* ring;
+    pthread_t consumer;
+    distribution consumptionDist;
+    distribution degradationDist;
+    distribution capacityDist;
+
+    //state of load mode
+    int epollfd;
+    simConsumer* consumers;
+    simTimer* heap;
+    int heapLen;
+    int active;             //consumers not finished yet
+    unsigned long bytes;
+    unsigned long portions;
+    unsigned long errors;
+    unsigned long degradationBytes;
+    samples firstByte;      //connect to first byte, us
+    samples completion;     //connect to last block of portion, us
+
+    //low latency profile
+    int cpus[MAXCPUS];      //receiving thread on the first, consumer of -P on the next one
+    int numOfCpus;
+    int busyPoll;           //us of SO_BUSY_POLL, 0 - off
+    int lockMemory;
+    int measureJitter;
+    samples jitter;         //us over requested sleep, in load mode lateness of consumer deadlines
 
 }dataContainer;
 
@@ -48,19 +156,76 @@ typedef struct datacontainer
 
 
 int parseInt(char* arr );
-float parseFloat(char* arr);
 void parseArguments(int argc, char** argv, dataContainer* d);
 void parseAddress(char* arg, dataContainer* d);
 void createSocket(dataContainer* d);
 void operateOnData(dataContainer* d);
 void extFun(int status, void* arg);
 void getData(dataContainer* d);
+void sendRequest(dataContainer* d);
+void recvBlock(dataContainer* d, char* block);
+int readGrant(dataContainer* d);
+uint32_t deadline(float degradation);
+
+//datagram transport
+int receivePortion(dataContainer* d);
+void requestMissing(dataContainer* d, int blocks);
+void sendControl(dataContainer* d, uint32_t flags, const uint32_t* which, int count);
+
+//local transport
+int receiveLocal(dataContainer* d);
+void mapShards(dataContainer* d, struct msghdr* msg, int shards);
+
+//integrity of blocks sealed by producent
+void checkBlock(dataContainer* d, const char* block, long* seq);
+void reportIntegrity(dataContainer* d);
+
+//pipelined mode, network stage and consumption stage
+void startConsumption(dataContainer* d);
+void stopConsumption(dataContainer* d);
+void* consumptionStage(void* arg);
+void receiveIntoRing(dataContainer* d);
+int magazineFree(magazineRing* r);
+
+//low latency profile
+void sleepMeasured(const struct timespec* ts, samples* jitter);
+
+//load generator mode, many consumers on one epoll
+void runLoad(dataContainer* d);
+void startConsumer(dataContainer* d, int id);
+void connectConsumer(dataContainer* d, int id);
+int requestPortion(dataContainer* d, int id);
+void onConsumerEvent(dataContainer* d, int id, uint32_t events);
+void readConsumer(dataContainer* d, int id);
+void wakeConsumer(dataContainer* d, int id);
+void finishPortion(dataContainer* d, int id);
+void failConsumer(dataContainer* d, int id, const char* reason, int err);
+void heapPush(dataContainer* d, unsigned long at, int id);
+simTimer heapPop(dataContainer* d);
+void addSample(samples* s, unsigned long value);
+void reportLoad(dataContainer* d, unsigned long elapsedUs);
+void reportPercentiles(const char* name, samples* s);
+unsigned long nowUs(void);
+void stopLoad(int sig);
+
+volatile sig_atomic_t loadStopped = 0;     //SIGINT/SIGTERM ends load mode with report
 
 int main(int argc, char** argv)
 {
     dataContainer d={0};
     parseArguments(argc,argv, &d);
-    parseAddress(argv[argc-1], &d);
+    if(d.local)
+        d.address = argv[argc-1];   //path of Unix socket
+    else
+        parseAddress(argv[argc-1], &d);
+    if(d.integrity)
+        crc32cInit();
+    pinThread(pthread_self(), d.cpus, d.numOfCpus, 0, "receiver");
+    if(d.numOfConsumers > 0)
+    {
+        runLoad(&d);
+        return 0;
+    }
     operateOnData(&d);
     
 	close(d.socket);
@@ -71,36 +236,86 @@ int main(int argc, char** argv)
 void parseArguments(int argc, char** argv, dataContainer* d)
 {
   int opt;
-  while( (opt=getopt(argc, argv, "p:d:c:")) != -1 )
+  while( (opt=getopt(argc, argv, "p:d:c:HkL:PIUXA:b:Mj")) != -1 )
   {
     switch(opt)
     {
       case 'p':
-            d->consumption = parseFloat(optarg);
+            parseDistribution(optarg, &d->consumptionDist);
+            d->consumption = d->consumptionDist.values[0];
             break;
      case 'd':
-            d->degradation = parseFloat(optarg);
+            parseDistribution(optarg, &d->degradationDist);
+            d->degradation = d->degradationDist.values[0];
             break;
      case 'c':
-            d->capacity = parseInt(optarg);
+            parseDistribution(optarg, &d->capacityDist);
+            d->capacity = (int)d->capacityDist.values[0];
             d->magazineCapacity = d->capacity * MAGAZINE;
             break;
+     case 'H':
+            d->negotiate = 1;
+            break;
+     case 'k':
+            d->keepAlive = 1;
+            d->negotiate = 1;
+            break;
+     case 'L':
+            d->numOfConsumers = parseInt(optarg);
+            break;
+     case 'P':
+            d->pipelined = 1;
+            break;
+     case 'I':
+            d->integrity = 1;
+            break;
+     case 'U':
+            d->datagrams = 1;
+            d->negotiate = 1;   //server learns size of portion only from request
+            break;
+     case 'X':
+            d->local = 1;
+            d->negotiate = 1;
+            break;
+     case 'A':
+            d->numOfCpus = parseCpus(optarg, d->cpus);
+            break;
+     case 'b':
+            d->busyPoll = parseInt(optarg);
+            break;
+     case 'M':
+            d->lockMemory = 1;
+            break;
+     case 'j':
+            d->measureJitter = 1;
+            break;
      
       default:
             printf("Wrong parameters!\n");
             exit(EXIT_FAILURE);
     }
   }
-}
-
-float parseFloat(char* arr) 
-{
-    errno = 0;
-    char* eptr;
-    float val = strtof(arr, &eptr);
-    if(*eptr != '\0'|| errno == ERANGE ) 
-        errExit("strtof");
-    return val;
+  if(d->numOfConsumers == 0 && (d->consumptionDist.count > 1 || d->degradationDist.count > 1 
+        || d->capacityDist.count > 1))
+  {
+    printf("distributions can be used only with -L\n");
+    exit(EXIT_FAILURE);
+  }
+  if(d->numOfConsumers > 0 && d->pipelined)
+  {
+    printf("-P is for single consumer, consumers of -L don't block on their own\n");
+    exit(EXIT_FAILURE);
+  }
+  if(d->datagrams && (d->numOfConsumers > 0 || d->pipelined || d->keepAlive))
+  {
+    printf("-U receives whole portion before consumption, it can't be used with -L, -P or -k\n");
+    exit(EXIT_FAILURE);
+  }
+  if(d->local && (d->numOfConsumers > 0 || d->pipelined || d->datagrams || d->integrity))
+  {
+    printf("-X copies raw storage before consumption, it can't be used with -L, -P, -U or -I\n");
+    exit(EXIT_FAILURE);
+  }
 }
 
 void parseAddress(char* arg, dataContainer* d)
@@ -147,8 +362,27 @@ int parseInt(char* arr )
 
 void createSocket(dataContainer* d)
 {
-    if ((d->socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) 
+    if(d->local)
+    {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, d->address, sizeof(addr.sun_path) - 1);
+        if((d->socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+            errExit("socket");
+        if(connect(d->socket, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+            errExit("connect");
+        if(clock_gettime(CLOCK_REALTIME, &(d->ts) )== -1)
+            errExit("clock_gettime");
+        return;
+    }
+    if ((d->socket = socket(AF_INET, d->datagrams ? SOCK_DGRAM : SOCK_STREAM, 0)) == -1) 
         errExit("socket");
+    int size = UDPRCVBUF;   //kernel caps it at rmem_max, what doesn't fit is asked for again
+    if(d->datagrams && setsockopt(d->socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)
+        errExit("setsockopt");
+    d->cookie = 0;  //cookie belongs to address, new socket has new port
+    if(d->busyPoll > 0)
+        setBusyPoll(&d->busyPoll, d->socket);
 	
 	d->server.sin_family = AF_INET;
 	d->server.sin_port = htons( d->port );
@@ -157,6 +391,7 @@ void createSocket(dataContainer* d)
 
     if (connect(d->socket , (struct sockaddr *)&d->server , sizeof(d->server)) < 0)
         errExit("connect");
+    d->seq = 0;
 
     if(clock_gettime(CLOCK_REALTIME, &(d->ts) )== -1)
         errExit("clock_gettime");
@@ -165,11 +400,28 @@ void createSocket(dataContainer* d)
 void operateOnData(dataContainer* d)
 {
     struct timespec ts = {0};
+    if(d->pipelined)
+        startConsumption(d);
+    if(d->lockMemory)
+        lockMemory();   //ring and consumer thread are there
+    int connected = 0;
 	while(d->magazineCapacity > DATAPORTION)
 	{
-	    createSocket(d);
+        if(!d->keepAlive || !connected)
+            createSocket(d);
+        else if(clock_gettime(CLOCK_REALTIME, &(d->ts) )== -1)
+            errExit("clock_gettime");   //time of waiting is counted from request, not from connect
+        connected = 1;
+        if(d->negotiate)
+            sendRequest(d);
         getData(d);
 	}
+    if(d->pipelined)
+        stopConsumption(d);     //magazine is full when the last received block is consumed
+    if(d->integrity)
+        reportIntegrity(d);
+    if(d->measureJitter)
+        reportPercentiles("Sleep jitter", &d->jitter);
 
     close(d->socket);
 
@@ -192,16 +444,25 @@ void getData(dataContainer* d)
     ts2.tv_sec = (long)times;
     ts2.tv_nsec = (long)((times - ts2.tv_sec )*1e9);
 
+    int blocks = 4;
+    if(d->datagrams)
+        blocks = receivePortion(d);
+    else if(d->local)
+        blocks = receiveLocal(d);
+    else if(d->negotiate)
+        blocks = readGrant(d);
     
-    for(int i=0; i< 4; i++)
+    for(int i=0; i< blocks; i++)
     {
-        if( recv(d->socket, server_reply, DATABLOCK, 0) == -1)
-            errExit("recv");
-
-        d->magazineCapacity -= DATABLOCK;
-
-        if(nanosleep(&ts2, NULL) == -1)
-            errExit("nanosleep");
+        if(d->pipelined)
+            receiveIntoRing(d);     //consumption goes on in other thread meanwhile, it fills magazine
+        else
+        {
+            if(!d->datagrams && !d->local)   //otherwise whole portion is in d->portion already
+                recvBlock(d, server_reply);
+            sleepMeasured(&ts2, d->measureJitter ? &d->jitter : NULL);
+            d->magazineCapacity -= DATABLOCK;
+        }
 
         if(i == 0)
         {
@@ -238,17 +499,402 @@ void getData(dataContainer* d)
         ttR->connectAndFirstPackage.tv_nsec = 1e9 + ttR->connectAndFirstPackage.tv_nsec;
     }
 
-    int deg =  (int)((double)ttR->firstPorionAndEnd.tv_sec + (double)(ttR->firstPorionAndEnd.tv_nsec/1e9));
-    int deg2 = (int)((double)ttR->connectAndFirstPackage.tv_sec + (double)(ttR->connectAndFirstPackage.tv_nsec/1e9));   //time of waiting in ring buffer
-    d->magazineCapacity = d->magazineCapacity +  (int)(deg * DEGRADATION_TIME * d->degradation) + (int)(deg2 * DEGRADATION_TIME * d->degradation) ;
+    if(d->pipelined)
+        d->magazineCapacity = magazineFree(d->ring);     //consumer knows when it really starved
+    else
+    {
+        int deg =  (int)((double)ttR->firstPorionAndEnd.tv_sec + (double)(ttR->firstPorionAndEnd.tv_nsec/1e9));
+        int deg2 = (int)((double)ttR->connectAndFirstPackage.tv_sec + (double)(ttR->connectAndFirstPackage.tv_nsec/1e9));   //time of waiting in ring buffer
+        d->magazineCapacity = d->magazineCapacity +  (int)(deg * DEGRADATION_TIME * d->degradation) + (int)(deg2 * DEGRADATION_TIME * d->degradation) ;
+    }
 
     socklen_t s = sizeof(ttR->addr);
-    if( getsockname(d->socket, (struct sockaddr* )&(ttR->addr), ( socklen_t* )&s) == -1)
+    if( !d->local && getsockname(d->socket, (struct sockaddr* )&(ttR->addr), ( socklen_t* )&s) == -1)
         errExit("getsockname");
 
     on_exit(extFun, ttR);
 }
 
+//block can come in many parts, it is consumed only when it is whole
+void recvBlock(dataContainer* d, char* block)
+{
+    for(int got = 0; got < DATABLOCK; )
+    {
+        ssize_t r = recv(d->socket, block + got, DATABLOCK - got, 0);
+        if(r == -1 && errno == EINTR)
+            continue;
+        if(r == -1)
+            errExit("recv");
+        if(r == 0)
+        {
+            fprintf(stderr, "connection closed in the middle of portion\n");
+            exit(EXIT_FAILURE);
+        }
+        got += r;
+    }
+    if(d->integrity)
+        checkBlock(d, block, &d->seq);
+}
+
+/*
+datagrams come in any order and some of them never, server keeps the portion for a while
+and sends again what is asked for; blocks are checked in their order when all are here
+*/
+int receivePortion(dataContainer* d)
+{
+    char bufs[UDPBATCH][sizeof(datagramHeader) + DATABLOCK];
+    struct iovec iov[UDPBATCH];
+    struct mmsghdr msgs[UDPBATCH];
+    int blocks = 0;
+    int got = 0;
+    int retries = 0;
+    while(blocks == 0 || got < blocks)
+    {
+        struct pollfd p = { d->socket, POLLIN, 0 };
+        int r = poll(&p, 1, blocks == 0 ? UDPREQUEST : UDPRESEND);
+        if(r == -1 && errno == EINTR)
+            continue;
+        if(r == -1)
+            errExit("poll");
+        if(r == 0 && blocks == 0)
+        {
+            sendRequest(d);     //request itself could be lost, while queued server only ignores it
+            continue;
+        }
+        if(r == 0)
+        {
+            if(++retries > UDPRETRIES)
+            {
+                fprintf(stderr, "server stopped answering, %d of %d blocks received\n", got, blocks);
+                exit(EXIT_FAILURE);
+            }
+            requestMissing(d, blocks);
+            continue;
+        }
+
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < UDPBATCH; i++)
+        {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(d->socket, msgs, UDPBATCH, MSG_DONTWAIT, NULL);
+        if(n == -1 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if(n == -1)
+            errExit("recvmmsg");
+        retries = 0;
+        for(int i = 0; i < n; i++)
+        {
+            datagramHeader h;
+            memcpy(&h, bufs[i], sizeof(h));
+            if(msgs[i].msg_len < sizeof(h) || ntohl(h.magic) != PROTOMAGIC)
+                continue;
+            if(msgs[i].msg_len == sizeof(h) && ntohl(h.index) == UDPREJECTED)
+            {
+                fprintf(stderr, "server is full, request rejected\n");
+                exit(EXIT_FAILURE);
+            }
+            if(msgs[i].msg_len == sizeof(h) && ntohl(h.index) == UDPCOOKIE && blocks == 0)
+            {
+                d->cookie = h.blocks;
+                sendRequest(d);     //now it is taken
+                continue;
+            }
+            if(msgs[i].msg_len != sizeof(bufs[i]))
+                continue;
+            if(blocks == 0)
+            {
+                blocks = ntohl(h.blocks);
+                if(d->portionCap < blocks)
+                {
+                    d->portionCap = blocks;
+                    if((d->portion = realloc(d->portion, (size_t)blocks * DATABLOCK)) == NULL
+                        || (d->arrived = realloc(d->arrived, blocks)) == NULL)
+                        errExit("realloc");
+                }
+                memset(d->arrived, 0, blocks);
+            }
+            uint32_t idx = ntohl(h.index);
+            if(idx >= (uint32_t)blocks || d->arrived[idx])
+                continue;   //duplicate of block resent too early
+            memcpy(d->portion + (size_t)idx * DATABLOCK, bufs[i] + sizeof(h), DATABLOCK);
+            d->arrived[idx] = 1;
+            got++;
+        }
+    }
+    sendControl(d, REQ_DONE, NULL, 0);     //if it is lost, server forgets portion a bit later
+    if(d->integrity)
+        for(int i = 0; i < blocks; i++)
+            checkBlock(d, d->portion + (size_t)i * DATABLOCK, &d->seq);
+    return blocks;
+}
+
+//list of lost blocks has to fit into one datagram, the rest is asked for in next round
+void requestMissing(dataContainer* d, int blocks)
+{
+    uint32_t which[UDPMAXRESEND];
+    int count = 0;
+    for(int i = 0; i < blocks && count < UDPMAXRESEND; i++)
+        if(!d->arrived[i])
+            which[count++] = htonl(i);
+    sendControl(d, REQ_RESEND, which, count);
+}
+
+void sendControl(dataContainer* d, uint32_t flags, const uint32_t* which, int count)
+{
+    char buf[sizeof(requestHeader) + sizeof(d->cookie) + UDPMAXRESEND * sizeof(uint32_t)];
+    requestHeader h = { htonl(PROTOMAGIC), htonl(count), htonl(flags), 0 };
+    memcpy(buf, &h, sizeof(h));
+    size_t len = sizeof(h);
+    if(d->datagrams)    //local release is bare header
+    {
+        memcpy(buf + len, &d->cookie, sizeof(d->cookie));
+        len += sizeof(d->cookie);
+    }
+    if(count > 0)
+        memcpy(buf + len, which, count * sizeof(uint32_t));
+    len += count * sizeof(uint32_t);
+    if(send(d->socket, buf, len, 0) == -1 && errno != ECONNREFUSED)
+        errExit("send");
+}
+
+/*
+producent answers with places of blocks in its storage, they are copied at memory speed
+and given back at once, so storage is not held while magazine is consumed
+*/
+int receiveLocal(dataContainer* d)
+{
+    localGrant g;
+    char control[CMSG_SPACE(sizeof(int) * MAXSHARDS)];
+    struct iovec iov = { &g, sizeof(g) };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t r;
+    while((r = recvmsg(d->socket, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if(r == -1)
+        errExit("recvmsg");
+    //rejected connection gets only short grantHeader or nothing
+    if(r < (ssize_t)sizeof(g) && (r < (ssize_t)sizeof(grantHeader) || g.blocks == 0))
+    {
+        fprintf(stderr, "server is full, request rejected\n");
+        exit(EXIT_FAILURE);
+    }
+    if(r != sizeof(g) || g.magic != PROTOMAGIC || g.parts > MAXSHARDS || g.shards > MAXSHARDS)
+    {
+        fprintf(stderr, "wrong answer from server\n");
+        exit(EXIT_FAILURE);
+    }
+    mapShards(d, &msg, g.shards);
+
+    if(d->portionCap < (int)g.blocks)
+    {
+        d->portionCap = g.blocks;
+        if((d->portion = realloc(d->portion, (size_t)g.blocks * DATABLOCK)) == NULL)
+            errExit("realloc");
+    }
+    size_t off = 0;
+    for(uint32_t i = 0; i < g.parts; i++)
+    {
+        localPart* p = &g.part[i];
+        if(p->shard >= g.shards || d->shards[p->shard] == NULL || off + p->len > (size_t)g.blocks * DATABLOCK)
+        {
+            fprintf(stderr, "wrong answer from server\n");
+            exit(EXIT_FAILURE);
+        }
+        const char* data = d->shards[p->shard] + g.dataOffset;
+        uint64_t pos = p->start % g.capacity;
+        uint64_t first = g.capacity - pos < p->len ? g.capacity - pos : p->len;
+        memcpy(d->portion + off, data + pos, first);
+        memcpy(d->portion + off + first, data, p->len - first);
+        off += p->len;
+    }
+    sendControl(d, REQ_DONE, NULL, 0);
+    return g.blocks;
+}
+
+//descriptors come only with the first grant on connection, storage stays mapped for next connections
+void mapShards(dataContainer* d, struct msghdr* msg, int shards)
+{
+    struct cmsghdr* c = CMSG_FIRSTHDR(msg);
+    if(c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+        return;
+    int fds[MAXSHARDS];
+    int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(c), n * sizeof(int));
+    for(int i = 0; i < n; i++)
+    {
+        struct stat st;
+        if(i < shards && d->shards[i] == NULL)
+        {
+            if(fstat(fds[i], &st) == -1)
+                errExit("fstat");
+            if((d->shards[i] = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[i], 0)) == MAP_FAILED)
+                errExit("mmap");
+        }
+        close(fds[i]);
+    }
+}
+
+//whole free space of magazine in one connection
+void sendRequest(dataContainer* d)
+{
+    requestHeader h = { htonl(PROTOMAGIC), htonl(d->magazineCapacity / DATABLOCK), htonl(d->keepAlive ? REQ_KEEPALIVE : 0),
+        htonl(deadline(d->degradation)) };
+    char buf[sizeof(h) + sizeof(d->cookie)];
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), &d->cookie, sizeof(d->cookie));
+    ssize_t len = sizeof(h) + (d->datagrams ? sizeof(d->cookie) : 0);
+    if( send(d->socket, buf, len, 0) != len)
+        errExit("send");
+}
+
+//magazine degrades by DEGRADATION_TIME * degradation bytes per second of waiting
+uint32_t deadline(float degradation)
+{
+    if(degradation <= 0)
+        return 0;
+    return (uint32_t)(1000.0 * DATABLOCK / (DEGRADATION_TIME * degradation));
+}
+
+int readGrant(dataContainer* d)
+{
+    grantHeader g;
+    if( recv(d->socket, &g, sizeof(g), MSG_WAITALL) != sizeof(g))
+        errExit("recv");
+    if( ntohl(g.magic) != PROTOMAGIC)
+    {
+        fprintf(stderr, "wrong answer from server\n");
+        exit(EXIT_FAILURE);
+    }
+    if(g.blocks == 0)
+    {
+        fprintf(stderr, "server is full, request rejected\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t blocks = ntohl(g.blocks);
+    //broadcast numbers blocks in stream, so the first one of every portion is taken as it is
+    if(blocks & GRANT_BROADCAST)
+        d->seq = -1;
+    return blocks & ~GRANT_BROADCAST;
+}
+
+void startConsumption(dataContainer* d)
+{
+    if((d->ring = calloc(1, sizeof(magazineRing))) == NULL)
+        errExit("calloc");
+    d->ring->consumption = d->consumption;
+    d->ring->degradation = d->degradation;
+    d->ring->magazine = d->magazineCapacity;
+    d->ring->jitter = d->measureJitter ? &d->jitter : NULL;   //read by this thread only after join
+    if((errno = pthread_create(&d->consumer, NULL, consumptionStage, d->ring)) != 0)
+        errExit("pthread_create");
+    pinThread(d->consumer, d->cpus, d->numOfCpus, 1, "consumer");
+}
+
+//consumer takes what is already received, then it ends
+void stopConsumption(dataContainer* d)
+{
+    atomic_store_explicit(&d->ring->done, 1, memory_order_release);
+    if((errno = pthread_join(d->consumer, NULL)) != 0)
+        errExit("pthread_join");
+    d->magazineCapacity = magazineFree(d->ring);
+    free(d->ring);
+}
+
+/*
+consumes blocks at the same pace as getData does, but receiving doesn't wait for it;
+block gets into magazine when it is consumed, magazine degrades only for the time
+when ring is empty after the first block came
+*/
+void* consumptionStage(void* arg)
+{
+    magazineRing* r = arg;
+    struct timespec ts = {0};
+    struct timespec idle = { 0, PIPEIDLE };
+    double times = DATABLOCK / (CONSUMPTION_TIME * r->consumption);
+    ts.tv_sec = (long)times;
+    ts.tv_nsec = (long)((times - ts.tv_sec )*1e9);
+    double owed = 0;    //fraction of byte, degradation is counted in whole bytes
+    unsigned long idleSince = 0;
+    int started = 0;    //idle clock starts with the first block, not with thread
+    volatile unsigned char sum = 0;
+
+    while(1)
+    {
+        unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if(tail == atomic_load_explicit(&r->head, memory_order_acquire))
+        {
+            if(atomic_load_explicit(&r->done, memory_order_acquire) && 
+                tail == atomic_load_explicit(&r->head, memory_order_acquire))
+                break;
+            if(started && idleSince == 0)
+                idleSince = nowUs();
+            if(nanosleep(&idle, NULL) == -1 && errno != EINTR)
+                errExit("nanosleep");
+            continue;
+        }
+        if(idleSince != 0)
+        {
+            owed += (nowUs() - idleSince) / 1e6 * DEGRADATION_TIME * r->degradation;
+            atomic_fetch_add(&r->magazine, (long)owed);
+            owed -= (unsigned long)owed;
+            idleSince = 0;
+        }
+
+        char* block = r->blocks[tail % PIPEBLOCKS];
+        for(int i = 0; i < DATABLOCK; i += 64)
+            sum += block[i];    //consumer really reads data
+        sleepMeasured(&ts, r->jitter);
+        atomic_fetch_sub(&r->magazine, DATABLOCK);
+        atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+        started = 1;
+    }
+    return NULL;
+}
+
+/*
+blocks still in ring already have their place in magazine; tail is read first,
+so block consumed meanwhile is counted twice and free space is never too big
+*/
+int magazineFree(magazineRing* r)
+{
+    unsigned long tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    long room = atomic_load(&r->magazine);
+    return room - (long)(atomic_load_explicit(&r->head, memory_order_relaxed) - tail) * DATABLOCK;
+}
+
+//waits only when consumer is PIPEBLOCKS behind, then socket buffer fills and server sees it
+void receiveIntoRing(dataContainer* d)
+{
+    magazineRing* r = d->ring;
+    struct timespec idle = { 0, PIPEIDLE };
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    while(head - atomic_load_explicit(&r->tail, memory_order_acquire) == PIPEBLOCKS)
+        if(nanosleep(&idle, NULL) == -1 && errno != EINTR)
+            errExit("nanosleep");
+    recvBlock(d, r->blocks[head % PIPEBLOCKS]);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+//what sleep takes over requested time is noise of scheduler, consumption of block gets longer by it
+void sleepMeasured(const struct timespec* ts, samples* jitter)
+{
+    unsigned long before = jitter != NULL ? nowUs() : 0;
+    if(nanosleep(ts, NULL) == -1 && errno != EINTR)
+        errExit("nanosleep");
+    if(jitter == NULL)
+        return;
+    long over = (long)(nowUs() - before) - (ts->tv_sec * 1000000L + ts->tv_nsec / 1000);
+    addSample(jitter, over > 0 ? over : 0);
+}
+
 void extFun(int status, void* arg)
 {
     timesToReport* t = ( timesToReport* )arg;
@@ -256,4 +902,417 @@ void extFun(int status, void* arg)
     fprintf(stderr, "Time between first package and disconnection: %ld.%ld\n",t->connectAndFirstPackage.tv_sec, t->connectAndFirstPackage.tv_nsec);
     fprintf(stderr, "Delay between first and last package: %ld.%ld\n", t->firstPorionAndEnd.tv_sec, t->firstPorionAndEnd.tv_nsec);
     printf("status: %d\n", status); //just to remove warnings from -Wall -Wextra -Wpedantic
-}
\ No newline at end of file
+}
+/*
+load generator: every simulated consumer connects, receives its portion and reconnects
+while magazine has room, like operateOnData. Consuming a block is a deadline in heap,
+so thousands of consumers live in one thread
+*/
+void runLoad(dataContainer* d)
+{
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;      //every consumer has its own socket
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopLoad);
+    signal(SIGTERM, stopLoad);
+    srand48(getpid() ^ time(NULL));
+
+    if((d->epollfd = epoll_create1(0)) == -1)
+        errExit("epoll_create1");
+    d->consumers = calloc(d->numOfConsumers, sizeof(simConsumer));
+    d->heap = calloc(d->numOfConsumers, sizeof(simTimer));
+    if(d->consumers == NULL || d->heap == NULL)
+        errExit("calloc");
+    if(d->lockMemory)
+        lockMemory();
+
+    unsigned long start = nowUs();
+    for(int i = 0; i < d->numOfConsumers; i++)
+        startConsumer(d, i);
+
+    struct epoll_event events[MAXEVENTS];
+    while(d->active > 0 && !loadStopped)
+    {
+        int timeout = -1;
+        if(d->heapLen > 0)
+        {
+            unsigned long now = nowUs();
+            timeout = d->heap[0].at > now ? (int)((d->heap[0].at - now + 999) / 1000) : 0;
+        }
+        int nfds = epoll_wait(d->epollfd, events, MAXEVENTS, timeout);
+        if(nfds == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            errExit("epoll_wait");
+        }
+        for(int i = 0; i < nfds; i++)
+            onConsumerEvent(d, events[i].data.u32, events[i].events);
+
+        unsigned long now = nowUs();
+        while(d->heapLen > 0 && d->heap[0].at <= now)
+        {
+            simTimer t = heapPop(d);
+            if(d->measureJitter)
+                addSample(&d->jitter, now - t.at);
+            wakeConsumer(d, t.id);
+        }
+    }
+    reportLoad(d, nowUs() - start);
+}
+
+void startConsumer(dataContainer* d, int id)
+{
+    simConsumer* c = &d->consumers[id];
+    c->consumption = drawValue(&d->consumptionDist);
+    c->degradation = drawValue(&d->degradationDist);
+    c->magazineCapacity = (int)(drawValue(&d->capacityDist) + 0.5) * MAGAZINE;
+    if(d->integrity && (c->block = malloc(DATABLOCK)) == NULL)
+        errExit("malloc");
+    d->active++;
+    if(c->magazineCapacity > DATAPORTION)
+        connectConsumer(d, id);
+    else
+    {
+        c->state = SIM_DONE;
+        d->active--;
+    }
+}
+
+void connectConsumer(dataContainer* d, int id)
+{
+    simConsumer* c = &d->consumers[id];
+    c->seq = 0;
+    if((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        errExit("socket");
+    if(d->busyPoll > 0)
+        setBusyPoll(&d->busyPoll, c->fd);
+    d->server.sin_family = AF_INET;
+    d->server.sin_port = htons( d->port );
+    if(inet_pton(AF_INET, d->address, &d->server.sin_addr)==0)  
+        errExit("inet_pton");
+
+    c->connectUs = nowUs();
+    c->state = SIM_CONNECTING;
+    if(connect(c->fd, (struct sockaddr *)&d->server, sizeof(d->server)) == -1 && errno != EINPROGRESS)
+    {
+        failConsumer(d, id, "connect", errno);
+        return;
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLOUT;
+    ev.data.u32 = id;
+    if(epoll_ctl(d->epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+        errExit("epoll_ctl");
+}
+
+void onConsumerEvent(dataContainer* d, int id, uint32_t events)
+{
+    simConsumer* c = &d->consumers[id];
+    if(c->state == SIM_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+        {
+            failConsumer(d, id, "connect", err);
+            return;
+        }
+        if(!requestPortion(d, id))
+            return;
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = id;
+        if(epoll_ctl(d->epollfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+            errExit("epoll_ctl");
+        return;
+    }
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        readConsumer(d, id);
+}
+
+//returns 0 when consumer failed
+int requestPortion(dataContainer* d, int id)
+{
+    simConsumer* c = &d->consumers[id];
+    c->firstUs = 0;
+    c->blockOff = 0;
+    c->grantOff = 0;
+    c->blocks = 4;
+    if(d->negotiate)
+    {
+        requestHeader h = { htonl(PROTOMAGIC), htonl(c->magazineCapacity / DATABLOCK), htonl(d->keepAlive ? REQ_KEEPALIVE : 0),
+            htonl(deadline(c->degradation)) };
+        if( send(c->fd, &h, sizeof(h), 0) != sizeof(h))
+        {
+            failConsumer(d, id, "send", errno);
+            return 0;
+        }
+    }
+    c->state = d->negotiate ? SIM_GRANT : SIM_RECEIVING;
+    return 1;
+}
+
+void readConsumer(dataContainer* d, int id)
+{
+    simConsumer* c = &d->consumers[id];
+    char buff[DATABLOCK];
+    while(c->state == SIM_GRANT)
+    {
+        ssize_t r = recv(c->fd, c->grant + c->grantOff, sizeof(grantHeader) - c->grantOff, 0);
+        if(r == -1 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if(r <= 0)
+        {
+            failConsumer(d, id, "recv", r == 0 ? 0 : errno);
+            return;
+        }
+        c->grantOff += r;
+        if(c->grantOff < (int)sizeof(grantHeader))
+            continue;
+        grantHeader g;
+        memcpy(&g, c->grant, sizeof(g));
+        if(ntohl(g.magic) != PROTOMAGIC)
+        {
+            failConsumer(d, id, "wrong answer from server", 0);
+            return;
+        }
+        if(g.blocks == 0)
+        {
+            failConsumer(d, id, "rejected by server", 0);
+            return;
+        }
+        c->blocks = ntohl(g.blocks) & ~GRANT_BROADCAST;
+        if(ntohl(g.blocks) & GRANT_BROADCAST)
+            c->seq = -1;
+        c->state = SIM_RECEIVING;
+    }
+
+    //only to the end of block, after every block consumer stops to consume it
+    ssize_t r = recv(c->fd, c->block != NULL ? c->block + c->blockOff : buff, DATABLOCK - c->blockOff, 0);
+    if(r == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if(r <= 0)
+    {
+        failConsumer(d, id, "server closed before end of portion", r == 0 ? 0 : errno);
+        return;
+    }
+    unsigned long now = nowUs();
+    if(c->firstUs == 0)
+    {
+        c->firstUs = now;
+        addSample(&d->firstByte, now - c->connectUs);
+    }
+    d->bytes += r;
+    c->blockOff += r;
+    if(c->blockOff < DATABLOCK)
+        return;
+
+    c->blockOff = 0;
+    if(c->block != NULL)
+        checkBlock(d, c->block, &c->seq);
+    c->blocks--;
+    c->magazineCapacity -= DATABLOCK;
+    if(c->blocks == 0)
+        addSample(&d->completion, now - c->connectUs);
+    if(c->blocks == 0 && !d->keepAlive)
+    {
+        close(c->fd);   //closing removes it from epoll
+        c->fd = -1;
+    }
+    else if(epoll_ctl(d->epollfd, EPOLL_CTL_DEL, c->fd, NULL) == -1)
+        errExit("epoll_ctl");
+
+    double times = DATABLOCK / (CONSUMPTION_TIME * c->consumption);
+    c->state = SIM_CONSUMING;
+    c->wakeAt = now + (unsigned long)(times * 1e6);
+    heapPush(d, c->wakeAt, id);
+}
+
+void wakeConsumer(dataContainer* d, int id)
+{
+    simConsumer* c = &d->consumers[id];
+    if(c->blocks == 0)
+    {
+        finishPortion(d, id);
+        return;
+    }
+    c->state = SIM_RECEIVING;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = id;
+    if(epoll_ctl(d->epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+        errExit("epoll_ctl");
+}
+
+//the same degradation as in getData, whole seconds of waiting and receiving
+void finishPortion(dataContainer* d, int id)
+{
+    simConsumer* c = &d->consumers[id];
+    unsigned long now = nowUs();
+    int deg = (int)((now - c->firstUs) / 1000000);
+    int deg2 = (int)((c->firstUs - c->connectUs) / 1000000);
+    int degradation = (int)(deg * DEGRADATION_TIME * c->degradation) + (int)(deg2 * DEGRADATION_TIME * c->degradation);
+    c->magazineCapacity += degradation;
+    d->degradationBytes += degradation;
+    d->portions++;
+    c->portions++;
+
+    if(c->magazineCapacity > DATAPORTION && d->keepAlive)
+    {
+        //next portion on the same socket, its latency is counted from the request
+        c->connectUs = nowUs();
+        if(!requestPortion(d, id))
+            return;
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = id;
+        if(epoll_ctl(d->epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+            errExit("epoll_ctl");
+    }
+    else if(c->magazineCapacity > DATAPORTION)
+        connectConsumer(d, id);
+    else
+    {
+        if(c->fd != -1)
+            close(c->fd);
+        c->fd = -1;
+        c->state = SIM_DONE;
+        d->active--;
+    }
+}
+
+//the single consumer would exit, here it only stops
+void failConsumer(dataContainer* d, int id, const char* reason, int err)
+{
+    simConsumer* c = &d->consumers[id];
+    if(d->errors < 10)
+        fprintf(stderr, "consumer %d: %s%s%s\n", id, reason, err ? ": " : "", err ? strerror(err) : "");
+    d->errors++;
+    if(c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+    c->state = SIM_DONE;
+    d->active--;
+}
+
+void heapPush(dataContainer* d, unsigned long at, int id)
+{
+    int i = d->heapLen++;
+    while(i > 0 && d->heap[(i - 1) / 2].at > at)
+    {
+        d->heap[i] = d->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    d->heap[i].at = at;
+    d->heap[i].id = id;
+}
+
+simTimer heapPop(dataContainer* d)
+{
+    simTimer top = d->heap[0];
+    simTimer last = d->heap[--d->heapLen];
+    int i = 0;
+    while(2 * i + 1 < d->heapLen)
+    {
+        int child = 2 * i + 1;
+        if(child + 1 < d->heapLen && d->heap[child + 1].at < d->heap[child].at)
+            child++;
+        if(last.at <= d->heap[child].at)
+            break;
+        d->heap[i] = d->heap[child];
+        i = child;
+    }
+    d->heap[i] = last;
+    return top;
+}
+
+void addSample(samples* s, unsigned long value)
+{
+    if(s->len == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        if((s->values = realloc(s->values, s->cap * sizeof(unsigned long))) == NULL)
+            errExit("realloc");
+    }
+    s->values[s->len++] = value;
+}
+
+void reportLoad(dataContainer* d, unsigned long elapsedUs)
+{
+    double seconds = elapsedUs / 1e6;
+    int starved = 0;
+    for(int i = 0; i < d->numOfConsumers; i++)
+        if(d->consumers[i].portions == 0)
+            starved++;
+    fprintf(stderr, "Consumers: %d; portions: %lu; errors: %lu; never served: %d; time: %.3f s\n", 
+        d->numOfConsumers, d->portions, d->errors, starved, seconds);
+    fprintf(stderr, "Received: %lu bytes; throughput: %.1f bytes/s\n", d->bytes, seconds > 0 ? d->bytes / seconds : 0);
+    fprintf(stderr, "Magazine degradation: %lu bytes\n", d->degradationBytes);
+    reportPercentiles("Connect to first byte", &d->firstByte);
+    reportPercentiles("Portion completion", &d->completion);
+    if(d->measureJitter)
+        reportPercentiles("Deadline lateness", &d->jitter);
+    if(d->integrity)
+        reportIntegrity(d);
+}
+
+/*
+block: 4 bytes of its number in connection, data, CRC32C of everything before;
+numbers higher than expected mean lost blocks, lower ones came out of order
+*/
+void checkBlock(dataContainer* d, const char* block, long* seq)
+{
+    uint32_t v;
+    memcpy(&v, block + DATABLOCK - sizeof(v), sizeof(v));
+    if(ntohl(v) != ~crc32c(~0U, (const unsigned char*)block, DATABLOCK - sizeof(v)))
+    {
+        d->badChecksum++;
+        return;     //number can't be trusted either
+    }
+    d->verified++;
+    memcpy(&v, block, sizeof(v));
+    long n = ntohl(v);
+    if(*seq >= 0 && n > *seq)
+        d->lostBlocks += n - *seq;
+    else if(*seq >= 0 && n < *seq)
+        d->reordered++;
+    *seq = n + 1;
+}
+
+void reportIntegrity(dataContainer* d)
+{
+    fprintf(stderr, "Integrity: %lu blocks verified; bad checksum: %lu; lost: %lu; out of order: %lu\n",
+        d->verified, d->badChecksum, d->lostBlocks, d->reordered);
+}
+
+void reportPercentiles(const char* name, samples* s)
+{
+    if(s->len == 0)
+    {
+        fprintf(stderr, "%s: no samples\n", name);
+        return;
+    }
+    qsort(s->values, s->len, sizeof(unsigned long), compareSamples);
+    fprintf(stderr, "%s [ms]: p50 %.3f p90 %.3f p99 %.3f max %.3f (%d samples)\n", name,
+        s->values[s->len / 2] / 1e3, s->values[s->len * 9 / 10] / 1e3, 
+        s->values[s->len * 99 / 100] / 1e3, s->values[s->len - 1] / 1e3, s->len);
+}
+
+void stopLoad(int sig)
+{
+    (void)sig;
+    loadStopped = 1;
+}
+
+unsigned long nowUs(void)
+{
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
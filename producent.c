@@ -13,43 +13,436 @@
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
-
-#define errExit(msg)    do { perror(msg); exit(EXIT_FAILURE);} while (0)
-
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include "common.h"
 
 #define RATE 2662
 #define BLOCK 640
-#define DATAPORTION 13312
-#define DATABLOCK 3328  // 13312 / 4 == 3328
-#define MAXCLIENTS 1000
+#define LISTENBACKLOG 65535 //kernel cuts it to net.core.somaxconn
+#define EVENTBATCH 1024     //first size of epoll_wait batch and of wait queue, both grow when filled
+#define MAXEVENTBATCH 65536
+#define FDRESERVE 64        //descriptors which are not clients: storage, epoll, timers, log, metrics
+#define ACCEPTRETRY 100     //ms, accept stopped for lack of descriptors or memory is tried again after so long
+#define RETAINEDBUFFERS 64  //free client records which keep their pending buffer
+#define RINGCAPACITY 65536  // same as default pipe capacity
+#define MAXSTORAGE (1L << 30)   //levels of storage are counted in int
+#define HUGEPAGE (2UL << 20)
+#define RINGMAGIC 0x4b4f4e5352494e47UL  //"KONSRING", file with ring can be used again after restart
+#define MAXREACTORS 64
+#define PREFAULTCLIENTS 4096    //client records made in advance with -M
+#define MAXGENERATORS MAXSHARDS  //every generator has its own shard of storage
+#define CLIENTSLAB 256      //client records allocated at once
+#define SENDBATCH 4         //max blocks sent to one client in one call in edge triggered mode
+#define GENTICK 1000000     //ns, shortest sleep of batched generator
+#define GENBURST 16         //blocks batched generator may catch up with after storage was full
+#define LETTERS 52          //blocks with different letters, then it starts from 'a' again
+#define VMSPLICEMIN 16384   //every vmsplice takes pipe slots for pages it touches, small batches are copied
+#define URINGENTRIES 4096   //submission queue of io_uring backend, completion queue is twice as big
+#define URINGTICK 1000000   //ns, how often io_uring backend checks waiting clients when it is not event driven
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)  //slots on every level of timing wheel
+#define WHEELLEVELS 4
+#define WHEELTICK 10000     //us, resolution of client deadlines
+#define REPORTPERIOD 5      //s, storage report
+#define LOGRECORDS 4096     //event records in ring of one reactor
+#define LOGIDLE 10000000    //ns, logger sleeps so long when all rings are empty
+#define HISTBUCKETS 32      //bucket i counts values from 2^(i-1) to 2^i microseconds
+#define MAXSWEEP 16         //alternatives of one simulation parameter
+#define UDPBATCH 64         //datagrams in one sendmmsg/recvmmsg
+#define UDPBUCKETS 4096     //hash of datagram clients by address
+#define UDPLINGER 2000      //ms, sent portion is kept so long for resends after last request
+#define LOCALHOLD 1000      //ms, local client has so long to copy its parts and give them back
+#define UDPCOOKIEPERIOD 10000   //ms, cookie of address changes so often, the previous one is still valid
+#define UDPRESENDRATE 1     //whole portions one client can get again per second
+
+//node of timing wheel, lists are circular with sentinel in every slot
+typedef struct wheelTimer
+{
+    struct wheelTimer* next;    //NULL when not armed
+    struct wheelTimer* prev;
+    unsigned long expires;      //in ticks of wheel
+}wheelTimer;
+
+/*
+hierarchical timing wheel: level 0 has one slot per tick, every next level has slots 64 times longer.
+Timers go down a level when wheel comes to their slot, so insert, cancel and expiry are O(1)
+*/
+typedef struct timingWheel
+{
+    unsigned long now;          //ticks since start
+    unsigned long startUs;
+    unsigned long nowUs;        //time of last advance, cheap timestamp for progress of clients
+    int count;
+    wheelTimer slots[WHEELLEVELS][WHEELSIZE];
+}timingWheel;
 
 typedef struct clientParameters
 {
+    struct clientParameters* next;  //free list of pool
     int fd;
-    int numOfRequestedBlocks;
+    int numOfRequestedBlocks;   //blocks still waiting in storage for this client
     struct sockaddr_in clientAddr;
+    char* pending;              //rest of block already taken from storage but not sent yet
+    int pendingLen;
+    int pendingOff;
+    int pendingCap;
+    int readingHeader;          //client is not in wait queue yet, we wait for its request
+    int keepAlive;              //goes back to readingHeader instead of being disconnected
+    unsigned int deadlineMs;    //from request, used by edf policy
+    unsigned long priority;     //key in wait queue, smaller goes first
+    unsigned long seq;          //order of coming, breaks ties
+    int queueIndex;             //place in wait queue, -1 - not there
+    wheelTimer timer;           //deadline of waiting, idleness or whole portion
+    unsigned long admittedUs;
+    unsigned long progressUs;   //last time client took data or sent header
+    int headerLen;
+    char header[sizeof(requestHeader)];
+    unsigned long acceptedUs;   //timestamps for metrics, CLOCK_MONOTONIC
+    unsigned long queuedUs;
+    unsigned long sendStartUs;  //blocks were taken from storage, 0 - nothing in flight
+    int sendBlocks;
+    int firstByteSent;
+    int readPending;            //io_uring: block is still counted in numOfBlocks until its read is done, 2 - read was short
+    uint32_t blockSeq;          //number of next block sent through this connection, with -I
+    int subIndex;               //broadcast: place in subscribers, -1 - not subscribed
+    unsigned long bcastNext;    //broadcast: number of next block to send
+    int bcastOff;               //bytes of that block already sent
+    int bcastWanted;            //blocks of portion not published yet
+    int bcastWriting;           //waits for EPOLLOUT
+    int dead;                   //closed while epoll batch still refers to it, freed after batch
+    int datagram;               //client over UDP, fd is shared socket of reactor
+    int udpBlocks;              //blocks of portion kept in pending for resends, 0 - not sent yet
+    struct clientParameters* udpNext;   //chain in hash of datagram clients
+    uint32_t udpCookie;         //every request of client has to carry it
+    double udpCredit;           //blocks which can be sent again now
+    unsigned long udpCreditUs;  //when credit was counted
+    int local;                  //came through Unix socket, reads storage itself
+    int ringSent;               //descriptors of storage went with first grant
+    localPart* localParts;      //held until client says it copied them
+    int localCount;
 }clientParameters;
 
+//part of ring already sent, but tail can't pass it, because earlier part is held by local client
+typedef struct releasedRun
+{
+    struct sharedRing* ring;
+    unsigned long start;
+    unsigned long end;
+}releasedRun;
+
+//storage shared with child, head and tail count all bytes ever written/taken
+typedef struct sharedRing
+{
+    _Atomic unsigned long head;
+    _Atomic unsigned long tail;
+    _Atomic unsigned long claimed;  //taken by reactors, tail follows it when sending is finished
+    unsigned long capacity;
+    unsigned long magic;
+    char data[];
+}sharedRing;
+
+//shared with child, tells when server wants to be woken up
+typedef struct generatorState
+{
+    _Atomic unsigned long produced;     //bytes generated since start
+    _Atomic unsigned long wakeAt[MAXREACTORS];   //value of produced which has to be signalled through eventfd, 0 - nothing
+    int eventfd[MAXREACTORS];
+}generatorState;
+
+//log2 buckets, only atomic adds, so every reactor and generator can write without lock
+typedef struct histogram
+{
+    _Atomic unsigned long count;
+    _Atomic unsigned long sum;      //microseconds
+    _Atomic unsigned long bucket[HISTBUCKETS];
+}histogram;
+
+//shared with child, dumped as JSON to everyone who connects to metrics socket
+typedef struct metrics
+{
+    unsigned long startUs;
+    _Atomic unsigned long accepted;
+    _Atomic long waiting;           //clients in wait queues of all reactors
+    _Atomic unsigned long served;
+    _Atomic unsigned long disconnected;
+    _Atomic unsigned long evicted;  //by deadlines of timing wheel
+    _Atomic unsigned long rejected; //over -Q limit in reject mode
+    _Atomic unsigned long records;  //client records allocated by all reactors
+    _Atomic unsigned long blocksSent;
+    _Atomic unsigned long bytesLost;
+    _Atomic unsigned long bytesGenerated;
+    histogram waitInQueue;
+    histogram acceptToFirstByte;
+    histogram blockSend;            //from taking block out of storage to its last byte accepted by socket
+}metrics;
+
+//shared with child, how much later than asked generators wake up, taken by every report
+typedef struct jitterStats
+{
+    histogram sleeps;       //microseconds over requested sleep
+    _Atomic unsigned long maxSleep;
+}jitterStats;
+
+enum logEvent { LOG_REPORT, LOG_DISCONNECTED, LOG_SERVED, LOG_NOREQUEST, LOG_BADREQUEST,
+    LOG_WAITEXPIRED, LOG_IDLE, LOG_TOOSLOW, LOG_REJECTED, LOG_PAUSED, LOG_LAGGING, LOG_JITTER };
+
+//fixed size, written as it is to binary log, so keep only numbers here
+typedef struct logRecord
+{
+    struct timespec ts;     //CLOCK_REALTIME
+    int type;
+    uint32_t addr;          //network byte order
+    int port;
+    int lost;               //bytes for LOG_DISCONNECTED, blocks for LOG_SERVED
+    int level;              //fields of LOG_REPORT, LOG_JITTER has p50, p99, max and timer lateness in them
+    int capacity;
+    int clients;
+    int flow;
+}logRecord;
+
+//one writer (reactor) and one reader (logger thread)
+typedef struct eventLog
+{
+    _Alignas(64) _Atomic unsigned long head;
+    _Alignas(64) _Atomic unsigned long tail;    //moved also by reactor when it overwrites
+    logRecord records[LOGRECORDS];
+}eventLog;
+
+typedef struct eventLogger
+{
+    int numOfRings;
+    int overwrite;          //when ring is full: 0 - new record is dropped, 1 - the oldest one
+    int outfd;              //binary records go there, -1 - text to stderr
+    _Atomic unsigned long dropped;
+    eventLog* rings;        //one for every reactor
+}eventLogger;
+
+//user_data of io_uring operations, client operations keep pointer to client in the rest of bits
+enum uringOp { URING_ACCEPT = 1, URING_REPORT, URING_TICK, URING_EVENTFD, URING_METRICS, URING_READ, URING_SEND };
+
+//rings mapped from kernel, we are the only submitter
+typedef struct uringState
+{
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqEntries;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned toSubmit;
+    int acceptArmed;                   //multishot accept still delivers connections
+    int singleAccept;                  //kernel has no multishot accept, it is armed for every connection
+    struct __kernel_timespec tick;     //read by kernel when timeout is submitted
+    struct __kernel_timespec report;
+    struct __kernel_timespec retry;    //ACCEPTRETRY, when event driven backend has no tick
+}uringState;
+
+//why accepting is stopped: limit waits for some client to go away, lack of resources for time
+enum acceptPause { PAUSE_NONE, PAUSE_LIMIT, PAUSE_RESOURCES };
+
+//order of admission from wait queue
+enum schedPolicy { POLICY_FIFO, POLICY_EDF, POLICY_LRM };
+
+//simulation: consumer of konsument -L reduced to numbers
+typedef struct virtualConsumer
+{
+    float consumption;
+    float degradation;
+    int freeSpace;          //free space of magazine in bytes
+    int blocks;             //portion being consumed
+    int portions;
+    unsigned long connectUs;
+    unsigned long firstUs;
+}virtualConsumer;
+
+enum simEventType { SIM_PRODUCE, SIM_CONNECT, SIM_CONSUMED };
+
+typedef struct simEvent
+{
+    unsigned long at;       //virtual microseconds
+    unsigned long seq;
+    int type;
+    int id;                 //consumer
+}simEvent;
+
+typedef struct sampleSet
+{
+    unsigned long* values;
+    int len;
+    int cap;
+}sampleSet;
+
+enum simKey { SIM_CLIENTS, SIM_RATE, SIM_CONSUMPTION, SIM_DEGRADATION, SIM_CAPACITY, SIMKEYS };
+
+typedef struct simulation
+{
+    char* values[SIMKEYS][MAXSWEEP];    //swept alternatives of every parameter
+    int count[SIMKEYS];
+    unsigned long startUs;  //consumers come when generator already filled storage for so long
+    unsigned long endUs;
+    long seed;
+
+    unsigned long now;
+    int level;              //bytes in virtual storage
+    unsigned long full;     //generator ticks lost because storage was full
+    virtualConsumer* consumers;
+    int active;             //consumers whose magazine is not full yet
+    simEvent* events;       //binary heap by time
+    int numOfEvents;
+    int eventsCap;
+    unsigned long nextEvent;
+    sampleSet waits;        //request to first byte
+    sampleSet completions;  //request to last block received
+    unsigned long portions;
+    unsigned long degradationBytes;
+}simulation;
+
+//broadcast: block taken from storage once and sent to every subscriber from this copy
+typedef struct sharedBlock
+{
+    struct sharedBlock* next;   //free list
+    int refs;                   //subscribers which haven't sent it yet
+    char data[DATABLOCK];
+}sharedBlock;
+
+struct dataContainer;
+
+//reactors working in separate threads, each has its own epoll, listening socket and clients
+typedef struct reactorGroup
+{
+    int numOfReactors;
+    pthread_mutex_t admitLock;  //checking storage and reserving blocks has to be done at once
+    struct dataContainer* shards[MAXREACTORS];
+}reactorGroup;
+
 typedef struct dataContainer
 {
     float frequency;
     int port;
     char* address;
     int server_fd;
+    int datagrams;      //portions also over UDP, on the same port
+    int udpfd;
+    clientParameters** udpBuckets;
+    uint64_t udpSecret;     //key of cookies
+    char* localPath;    //Unix socket for clients on the same host
+    int localfd;
+    int ringFds[MAXGENERATORS];
+    int localHolders;   //clients holding parts, releases after them are deferred
+    releasedRun* released;
+    int releasedLen;
+    int releasedCap;
     struct sockaddr_in server;
     int epollfd;
     struct epoll_event ev;
     int timerfd;
     int toRead;
-    int numOfBlocks;    //number of blocks of 3328 bytes to send to all clients
-    int numOfClients;
+    int useRing;        //storage in shared memory ring instead of pipe
+    int integrity;      //every block sent with sequence number and CRC32C
+    long storageSize;   //0 - default capacity of pipe
+    char* storagePath;  //ring in this file, it survives restart
+    int hugePages;      //ring in huge pages
+    int useSplice;      //move blocks from pipe to socket with splice()
+    int eventDriven;    //block in epoll_wait, generator wakes us through eventfd
+    int edgeTriggered;  //clients in EPOLLET, many blocks per wakeup without rearming
+    int negotiate;      //every client sends requestHeader with number of blocks
+    int useUring;       //io_uring backend instead of epoll
+    uringState* uring;  //NULL when epoll is used
+    int batchedGenerator;   //generator paced by clock, many blocks per wakeup
+    int useVmsplice;        //batched generator gives template pages to pipe instead of copying them
+    int eventfd;
+    generatorState* gen;
+    sharedRing* ring;               //in generator its own shard
+    sharedRing* shards[MAXGENERATORS];
+    int numOfGenerators;
+    int nextShard;                  //where reactor starts looking for data
+    int numOfReactors;
+    int reactorId;
+    reactorGroup* group;    //NULL when there is only one reactor
+    int splicePipe[2];      //blocks are moved here at once, so other reactors can't take the middle of block
+    _Atomic int numOfBlocks;    //number of blocks of 3328 bytes to send to all clients of this reactor
+    _Atomic int numOfClients;
     int generatedBytes;
+    char* metricsPath;
+    int metricsfd;
+    metrics* stats;         //NULL when metrics are off
+    int measureJitter;
+    jitterStats* jitter;    //NULL without -j
+    unsigned long lastReportUs;
+    int reactorCpus[MAXCPUS];   //-A, reactor i runs on reactorCpus[i % count]
+    int numOfReactorCpus;
+    int generatorCpus[MAXCPUS];
+    int numOfGeneratorCpus;
+    int busyPoll;           //us of SO_BUSY_POLL on client sockets, 0 - off
+    int lockMemory;         //mlockall and prefaulted client records
+    unsigned long lastScrapeUs;
+    unsigned long lastScrapeBytes;
+    char* logPath;          //binary event log, NULL - text on stderr
+    int logOverwrite;
+    eventLogger* logger;
+    eventLog* log;          //ring of this reactor
     
-    //circle buffer from previous task
-    int* ringBuffer;
-    int firstUsed;
-    int lastUsed;
+    clientParameters* freeClients;  //pool of client records of this reactor
+    int retainedBuffers;            //free records with pending buffer
+    int inBatch;                    //events of epoll_wait are being handled
+    clientParameters* deadClients;  //closed during batch, see freeDeadClients
+    struct epoll_event* events;     //batch of epoll_wait
+    int eventsCap;
+
+    //backpressure, every reactor has its share of -Q
+    int maxConnections;
+    int rejectOverLimit;    //1 - accept and refuse, 0 - leave connections in kernel backlog
+    int connections;        //accepted sockets of this reactor
+    int acceptPaused;       //listening socket is out of epoll (or accept is not armed in io_uring), see acceptPause
+    unsigned long acceptRetryUs;    //PAUSE_RESOURCES: when accept is tried again
+    clientParameters* listenRecord;
+    clientParameters* localRecord;
+    int localPaused;        //Unix listening socket is out of epoll, only for lack of resources
+
+    //broadcast mode, blocks not sent by everyone yet are kept in window
+    int broadcastLag;       //blocks subscriber may stay behind, 0 - no broadcast
+    sharedBlock** window;   //block n at n % broadcastLag
+    unsigned long published;
+    sharedBlock* freeBlocks;
+    clientParameters** subscribers;
+    int numOfSubscribers;
+    int subscribersCap;
+    int wanting;            //subscribers waiting for more blocks to be published
+
+    //waiting clients, binary heap ordered by policy
+    clientParameters** waitQueue;
     int size;
+    int queueCap;
+    int policy;
+    unsigned long nextSeq;
+
+    //deadlines in ms, 0 - off
+    int idleTimeout;        //client doesn't take data or doesn't send its request
+    int portionTimeout;     //whole portion from admission
+    int waitTimeout;        //time in wait queue
+    timingWheel wheel;
+
+    simulation* sim;        //NULL - real server
 
 }dataContainer;
 
@@ -60,37 +453,194 @@ struct sigevent   sev;
 void createServer(dataContainer* d);
 int createChild(dataContainer* d);
 void resourceDistribution(dataContainer* d);    //epoll_wait + for loop on every ready client
+void admitWaitingClients(dataContainer* d);
+void admitClient(dataContainer* d, clientParameters* cd);
+void armGeneratorWakeup(dataContainer* d, unsigned long wakeAt);
+
+//functions for many reactors
+void startReactors(dataContainer* d);
+void* reactorThread(void* arg);
+int reservedBlocks(dataContainer* d);
+int connectedClients(dataContainer* d);
+void lockAdmission(dataContainer* d);
+void unlockAdmission(dataContainer* d);
+
+//deadlines of clients
+int deadlinesEnabled(dataContainer* d);
+void wheelInit(timingWheel* w);
+void wheelAdd(timingWheel* w, wheelTimer* t, unsigned long expiresUs);
+void wheelCancel(timingWheel* w, wheelTimer* t);
+int wheelAdvance(dataContainer* d);
+void wheelPlace(timingWheel* w, wheelTimer* t);
+void armClientDeadline(dataContainer* d, clientParameters* cd);
+int clientExpired(dataContainer* d, clientParameters* cd);
+void evictClient(dataContainer* d, clientParameters* cd, int type);
+
+//discrete-event simulation with virtual clock
+void runSimulation(dataContainer* d);
+void simulateOne(dataContainer* d, int* idx);
+void simConnect(dataContainer* d, int id);
+void simAdmitted(dataContainer* d, clientParameters* cd);
+void simConsumed(dataContainer* d, int id);
+void simSchedule(simulation* s, unsigned long at, int type, int id);
+simEvent simNext(simulation* s);
+int simBefore(simEvent* a, simEvent* b);
+void sampleAdd(sampleSet* set, unsigned long value);
+unsigned long samplePercentile(sampleSet* set, double p);
+simulation* parseSimulation(char* arg, float rate);
+
+//event log, formatted by its own thread
+eventLogger* createLogger(dataContainer* d);
+void* loggerThread(void* arg);
+logRecord* logBegin(dataContainer* d, int type, clientParameters* cd);
+void logCommit(dataContainer* d);
+int logTake(eventLog* l, logRecord* rec);
+void printRecord(logRecord* rec);
+
+//io_uring backend, only for one reactor
+int uringSetup(dataContainer* d);
+void uringLoop(dataContainer* d);
+void uringHandle(dataContainer* d, struct io_uring_cqe* cqe);
+struct io_uring_sqe* uringSqe(dataContainer* d, int op, uint64_t data);
+int uringEnter(dataContainer* d, int wait);
+void uringArmAccept(dataContainer* d);
+void uringArmTimeout(dataContainer* d, int op, struct __kernel_timespec* ts);
+void uringArmPoll(dataContainer* d, int op, int fd);
+void uringSendBlock(dataContainer* d, clientParameters* cd);
+void uringQueueSend(dataContainer* d, clientParameters* cd);
+void uringSendDone(dataContainer* d, clientParameters* cd, int res);
+
+//metrics
+metrics* createMetrics(void);
+void createMetricsSocket(dataContainer* d);
+void sendMetrics(dataContainer* d);
+void writeMetrics(FILE* f, dataContainer* d);
+void writeHistogram(FILE* f, const char* name, histogram* h, int last);
+unsigned long histPercentile(histogram* h, double p);
+void histAdd(histogram* h, unsigned long us);
+void countStat(_Atomic unsigned long* counter, unsigned long value);
+unsigned long nowUs(void);
+void recordSendStart(dataContainer* d, clientParameters* cd, int blocks);
+void recordBlockSent(dataContainer* d, clientParameters* cd);
 
 
 //functions inside for loop in resourceDistribution function
 void acceptNewClient(dataContainer* d);
 void generateReport(dataContainer* d, int NumOfClients);
+void reportStorage(dataContainer* d, int NumOfClients);
 void checkClient(dataContainer* d, struct epoll_event* events, int iter , clientParameters* cd );
 int operateOnClient( struct epoll_event* events, int iter, dataContainer* d ); 
+void operateOnClientEdge(dataContainer* d, clientParameters* cd);
+void readClientHeader(dataContainer* d, clientParameters* cd);
+void dropClient(dataContainer* d, clientParameters* cd, int type);
+void finishPortion(dataContainer* d, clientParameters* cd);
 
 //function just after accept function
-void placeClientInRingBuffOrEpoll(dataContainer* d, int client_sock);
-void addClientToEpoll(dataContainer* d, int flags, int fdToAdd, int checkAddr, struct sockaddr_in addr);
+void placeClientInRingBuffOrEpoll(dataContainer* d, clientParameters* cd);
+void addClientToEpoll(dataContainer* d, int flags, clientParameters* cd);
+clientParameters* addFdToEpoll(dataContainer* d, int flags, int fd);
+
+//datagram transport
+void readDatagrams(dataContainer* d);
+void handleDatagram(dataContainer* d, const char* buf, int len, struct sockaddr_in* addr);
+void udpSendPortion(dataContainer* d, clientParameters* cd);
+void udpSendBlocks(dataContainer* d, clientParameters* cd, const uint32_t* which, int count);
+clientParameters* udpFind(dataContainer* d, struct sockaddr_in* addr);
+uint32_t udpCookie(dataContainer* d, struct sockaddr_in* addr, unsigned long period);
+void udpControl(dataContainer* d, struct sockaddr_in* addr, uint32_t index, uint32_t blocks);
+int udpResendCredit(dataContainer* d, clientParameters* cd, int count);
+void udpForget(dataContainer* d, clientParameters* cd);
+
+//local transport
+void createLocalServer(dataContainer* d);
+void acceptLocalClient(dataContainer* d);
+void localGrantParts(dataContainer* d, clientParameters* cd);
+void readLocalRelease(dataContainer* d, clientParameters* cd);
+void releaseLocal(dataContainer* d, clientParameters* cd);
+void deferRelease(dataContainer* d, sharedRing* r, unsigned long start, int bytes);
+
+//broadcast mode
+void subscribe(dataContainer* d, clientParameters* cd);
+void unsubscribe(dataContainer* d, clientParameters* cd);
+void publishBlocks(dataContainer* d);
+void sendBroadcast(dataContainer* d, clientParameters* cd);
+void releaseBlock(dataContainer* d, unsigned long n);
+void watchSubscriber(dataContainer* d, clientParameters* cd, int writing);
+
+//backpressure when there are too many connections
+void limitConnections(dataContainer* d);
+
+//low latency profile
+void prefaultClients(dataContainer* d);
+void sleepMeasured(dataContainer* d, const struct timespec* ts);
+void recordJitter(dataContainer* d, long us);
+void reportJitter(dataContainer* d);
+void pauseAccepting(dataContainer* d, int reason);
+void resumeAccepting(dataContainer* d);
+void retryAccepting(dataContainer* d);
+void rejectClient(dataContainer* d, int fd, struct sockaddr_in* addr);
 
 //addictional functions for preparing structures/removing clients
 void createSetEpoll(dataContainer* d);
 void armTimer(dataContainer* d);
+void createClientStructures(dataContainer* d);
 void disconnectFromServer(clientParameters* cd, dataContainer* d);
+void clientLost(dataContainer* d, clientParameters* cd);
+clientParameters* allocClient(dataContainer* d);
+void freeClient(dataContainer* d, clientParameters* cd);
+void closeClient(dataContainer* d, clientParameters* cd);
+void releaseRecord(dataContainer* d, clientParameters* cd);
+void freeDeadClients(dataContainer* d);
 
 // functions in child (magazine/resources creator)
 void child(int toWrite, dataContainer* d);
 int insertBlock(int fdToWrite, char c);
+void childRing(dataContainer* d);
+void insertBlockToRing(sharedRing* r, char c);
+void notifyServer(dataContainer* d, int bytes);
+void childBatched(int toWrite, dataContainer* d);
+char* createTemplate(void);
+int storageFree(int toWrite, dataContainer* d);
+ssize_t putIntoStorage(int toWrite, dataContainer* d, const char* src, size_t len);
+
+// storage functions (pipe or shared memory ring)
+sharedRing* createRing(unsigned long capacity, const char* path, int huge, int* keepFd);
+void createShards(dataContainer* d);
+void* mapRing(size_t len, int huge);
+void* mapMemfd(size_t len, int huge, int* fd);
+int readOnlyFd(int fd);
+void resizePipe(dataContainer* d, int fd[2]);
+int storageLevel(dataContainer* d);
+int storageCapacity(dataContainer* d);
+int storageUsable(dataContainer* d);
+void storageDiscard(dataContainer* d, int bytes);
+unsigned long ringClaim(sharedRing* r, int bytes);
+sharedRing* shardClaim(dataContainer* d, int bytes, unsigned long* start, int* len);
+void ringRelease(dataContainer* d, sharedRing* r, unsigned long start, int bytes);
+int storageSend(dataContainer* d, clientParameters* cd, int bytes);
+int sendPending(clientParameters* cd);
+void stashPending(clientParameters* cd, const char* src, int len);
+void storageCopy(dataContainer* d, char* buff, int bytes);
+
+//integrity of blocks: sequence number at the beginning, CRC32C of the rest at the end
+void sealBlock(char* block, uint32_t seq);
 
 //parse functions
 int parseInt(char* arr );
-float parseFloat(char* arr);
+long parseSize(char* arr);
 void parseArguments(int argc, char** argv, dataContainer* d);
 void parseAddress(char* arg, dataContainer* d);
 
-// ring buffer functions
-void addElem(dataContainer* b, int elem);
-int  removeFirstElem(dataContainer* b);
-int draw(dataContainer b, int e);
+// wait queue functions
+void addElem(dataContainer* b, clientParameters* elem);
+clientParameters* removeFirstElem(dataContainer* b);
+clientParameters* firstElem(dataContainer* b);
+clientParameters* removeElem(dataContainer* b, int i);
+void siftUp(dataContainer* b, int i);
+void siftDown(dataContainer* b, int i);
+clientParameters* draw(dataContainer b, int e);
+int goesBefore(clientParameters* a, clientParameters* b);
+void setPriority(dataContainer* d, clientParameters* cd);
 
 /*
 Dziwne zjawiska pogodowe:
@@ -106,17 +656,41 @@ int main(int argc, char** argv)
 {
     dataContainer d={0};
     parseArguments(argc,argv, &d);
+    if(d.integrity)
+        crc32cInit();
+    if(d.sim != NULL)
+    {
+        runSimulation(&d);  //no server, no generator
+        return 0;
+    }
     parseAddress(argv[argc-1], &d);
-    createServer(&d);
+    limitConnections(&d);   //before reactors, every one takes its share
     signal(SIGCHLD,SIG_IGN);  //I don't want to have zombie
+    if(d.metricsPath != NULL)
+        d.stats = createMetrics();  //before fork, generator counts its bytes there
+    if(d.measureJitter)
+    {
+        d.jitter = mmap(NULL, sizeof(jitterStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(d.jitter == MAP_FAILED)
+            errExit("mmap");
+    }
     d.toRead = createChild(&d);
+    if(d.metricsPath != NULL)
+        createMetricsSocket(&d);
+    d.logger = createLogger(&d);
+    pinThread(pthread_self(), d.reactorCpus, d.numOfReactorCpus, 0, "reactor");  //logger thread stays where scheduler wants it
+    if(d.numOfReactors > 1)
+        startReactors(&d);  //this thread stays as reactor 0
+    createServer(&d);
+    if(d.useUring && uringSetup(&d) == 0)
+        uringLoop(&d);
     armTimer(&d);
     createSetEpoll(&d);
     resourceDistribution(&d);
     
 
-    if(d.ringBuffer != NULL)
-        free(d.ringBuffer);
+    if(d.waitQueue != NULL)
+        free(d.waitQueue);
 
     close(d.toRead);
     close(d.server_fd);
@@ -130,12 +704,16 @@ void createServer(dataContainer* d)
 {
     int on = 1;
     
-    if ((d->server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) 
+    if ((d->server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) 
         errExit("socket");
 
     if( setsockopt(d->server_fd, SOL_SOCKET,  SO_REUSEADDR, (char *)&on, sizeof(on)) <0)
         errExit("setsockopt");
 
+    //every reactor listens on the same port, kernel spreads connections between them
+    if( d->group != NULL && setsockopt(d->server_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on)) <0)
+        errExit("setsockopt");
+
     d->server.sin_family = AF_INET; 
     d->server.sin_port = htons(d->port); 
     if(inet_pton(AF_INET, d->address, &d->server.sin_addr)==0)  
@@ -144,320 +722,3443 @@ void createServer(dataContainer* d)
     if (bind(d->server_fd, (struct sockaddr *)&d->server, sizeof(d->server))<0)
         errExit("bind");
 
-    if (listen(d->server_fd, MAXCLIENTS) < 0) 
+    if (listen(d->server_fd, LISTENBACKLOG) < 0) 
         errExit("listen");
 
+    if(d->localPath != NULL)
+        createLocalServer(d);
+    if(!d->datagrams)
+        return;
+    //with many reactors kernel hashes every client address always to the same one
+    if ((d->udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1) 
+        errExit("socket");
+    if( d->group != NULL && setsockopt(d->udpfd, SOL_SOCKET, SO_REUSEPORT, (char *)&on, sizeof(on)) <0)
+        errExit("setsockopt");
+    if (bind(d->udpfd, (struct sockaddr *)&d->server, sizeof(d->server))<0)
+        errExit("bind");
+    if(getrandom(&d->udpSecret, sizeof(d->udpSecret), 0) != sizeof(d->udpSecret))
+        errExit("getrandom");
+
 }
 
 int createChild(dataContainer* d)
 {
-    int fd[2];
-    if(pipe2(fd, O_NONBLOCK) == -1)
-        errExit("pipe");
+    int fd[2] = {-1, -1};
+    if(d->numOfGenerators == 0)
+        d->numOfGenerators = 1;
+    if(!d->useRing)
+    {
+        if(pipe2(fd, O_NONBLOCK) == -1)
+            errExit("pipe");
+        if(d->storageSize > 0)
+            resizePipe(d, fd);
+    }
+    if(d->useRing)
+        createShards(d);
 
-    pid_t pid = fork();
-    if(pid == -1)
-        errExit("fork");
-    else if( pid == 0)
+    if(d->eventDriven)
     {
-        close(fd[0]);   //close read end
-        signal(SIGPIPE,SIG_IGN);    
-        child(fd[1], d);
-        close(fd[1]);   //close write end
-        exit(EXIT_SUCCESS);
+        d->gen = mmap(NULL, sizeof(generatorState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(d->gen == MAP_FAILED)
+            errExit("mmap");
+        //every reactor waits for its own threshold
+        for(int i = 0; i < d->numOfReactors || i == 0; i++)
+            if((d->gen->eventfd[i] = eventfd(0, EFD_NONBLOCK)) == -1)
+                errExit("eventfd");
+        d->eventfd = d->gen->eventfd[0];
     }
-    close(fd[1]);
+
+    pid_t parent = getpid();
+    //every generator fills its own shard, together they keep the rate of -p
+    for(int i = 0; i < d->numOfGenerators; i++)
+    {
+        pid_t pid = fork();
+        if(pid == -1)
+            errExit("fork");
+        else if( pid == 0)
+        {
+            //there is no EPIPE on shared memory or when full pipe is never written, so die together with parent
+            if(prctl(PR_SET_PDEATHSIG, SIGTERM) == -1)
+                errExit("prctl");
+            if(getppid() != parent)
+                exit(EXIT_SUCCESS);
+            if(fd[0] != -1)
+                close(fd[0]);   //close read end
+            signal(SIGPIPE,SIG_IGN);    
+            if(d->useRing)
+                d->ring = d->shards[i];
+            d->frequency /= d->numOfGenerators;
+            pinThread(pthread_self(), d->generatorCpus, d->numOfGeneratorCpus, i, "generator");
+            if(d->lockMemory)
+                lockMemory();   //locks are not inherited by fork
+            child(fd[1], d);
+            if(fd[1] != -1)
+                close(fd[1]);   //close write end
+            exit(EXIT_SUCCESS);
+        }
+    }
+    if(fd[1] != -1)
+        close(fd[1]);
     return fd[0];
 }
 
 void resourceDistribution(dataContainer* d)
 {
-    struct epoll_event events[MAXCLIENTS];
+    d->eventsCap = EVENTBATCH;
+    if((d->events = malloc(d->eventsCap * sizeof(struct epoll_event))) == NULL)
+        errExit("malloc");
     int nfds;
-    int str;
     while( 1 )
     {
-        if( ioctl(d->toRead, FIONREAD, &str) == -1)
-            errExit("ioctl");
-        
-        while((d->size > 0) && (str >( (d->numOfBlocks * DATABLOCK)  + DATAPORTION)) )
-        {
-            int sockfd = removeFirstElem(d);
-            struct sockaddr_in addr = {0};
-            socklen_t addLen = sizeof(addr);
-            if(getpeername(sockfd, (struct sockaddr* )&addr, &addLen) == -1)
-                errExit("getpeername");
-            addClientToEpoll(d, (EPOLLOUT | EPOLLRDHUP) , sockfd, 1, addr );
-            d->numOfBlocks +=4;
-        }
+        if(!d->eventDriven)
+            admitWaitingClients(d);
 
-        if( (nfds = epoll_wait(d->epollfd, events, MAXCLIENTS, 0)) == -1)
+        int timeout = d->eventDriven ? (d->wheel.count > 0 ? WHEELTICK / 1000 : -1) : 0;
+        if(d->acceptPaused == PAUSE_RESOURCES && (timeout == -1 || timeout > ACCEPTRETRY))
+            timeout = ACCEPTRETRY;
+        struct epoll_event* events = d->events;
+        if( (nfds = epoll_wait(d->epollfd, events, d->eventsCap, timeout)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
             errExit("epoll_wait");
+        }
+        //after wait, so events below are stamped with current time
+        if(deadlinesEnabled(d))
+            d->wheel.nowUs = nowUs();
 
+        d->inBatch = 1;
         for(int i=0; i< nfds; i++)
         {
             clientParameters* cd = events[i].data.ptr;
+            if(cd->dead)
+                continue;
             if(cd->fd == d->server_fd)
                 acceptNewClient(d);
             else if(cd->fd == d->timerfd && events[i].events & EPOLLIN)
-                generateReport(d, d->numOfClients);  
+                generateReport(d, connectedClients(d));  
+            else if(d->eventDriven && cd->fd == d->eventfd)
+            {
+                eventfd_t val;
+                if(eventfd_read(d->eventfd, &val) == -1 && errno != EAGAIN)
+                    errExit("eventfd_read");
+                admitWaitingClients(d);
+            }
+            else if(d->stats != NULL && cd->fd == d->metricsfd)
+                sendMetrics(d);
+            else if(d->datagrams && cd->fd == d->udpfd)
+                readDatagrams(d);
+            else if(d->localPath != NULL && cd->fd == d->localfd)
+                acceptLocalClient(d);
             else
                 checkClient(d,events, i, cd);  
         }
+        d->inBatch = 0;
+        freeDeadClients(d);
+        retryAccepting(d);
+        //after batch, so no event refers to record of evicted client;
+        //evicted clients give their blocks back, so others can be admitted at once
+        if(wheelAdvance(d) > 0)
+            admitWaitingClients(d);
+        //full batch means more descriptors were ready, next wait takes more of them
+        if(nfds == d->eventsCap && d->eventsCap < MAXEVENTBATCH)
+        {
+            d->eventsCap *= 2;
+            if((d->events = realloc(d->events, d->eventsCap * sizeof(struct epoll_event))) == NULL)
+                errExit("realloc");
+        }
    }
 }
 
-void acceptNewClient(dataContainer* d)
-{
-    struct sockaddr_in client;
-    int client_sock;
-    int c = sizeof(struct sockaddr_in);
-    if((client_sock = accept(d->server_fd, (struct sockaddr *)&client, (socklen_t*)&c)) == -1)
-        errExit("accept");
-    
-    placeClientInRingBuffOrEpoll(d, client_sock);
-}
-
-void generateReport(dataContainer* d, int NumOfClients)
-{
-    struct timespec ts = {0};
-    int pipeCapacity = fcntl(d->toRead, F_GETPIPE_SZ);
-    int str;
-    if( ioctl(d->toRead, FIONREAD, &str) == -1)
-        errExit("ioctl");
-    uint64_t numExp;
-    if ((numExp = read(d->timerfd, &numExp, sizeof(uint64_t)) != sizeof(uint64_t)) )            
-        errExit("read");
-    if(clock_gettime(CLOCK_REALTIME, &ts)== -1)
-        errExit("clock_gettime");
-    fprintf(stderr, "TS: %ld.%ld bytes in pipe: %d,  %.2f%%; number of connected clients %d flow %d\n",ts.tv_sec, ts.tv_nsec, 
-    str, ( ( (float)str )/( (float)pipeCapacity ) )*100, NumOfClients, str - d->generatedBytes );
-    d->generatedBytes = str;
-}
-
-void checkClient(dataContainer* d, struct epoll_event* events, int iter , clientParameters* cd)
+//moves clients from wait queue to epoll while storage has data not reserved by others
+void admitWaitingClients(dataContainer* d)
 {
-    struct timespec ts = {0};
-    if( events[iter].events & EPOLLRDHUP )   
+    unsigned long produced = 0;
+    if(d->broadcastLag > 0)
     {
-        d->numOfClients--;
-        d->numOfBlocks -= cd->numOfRequestedBlocks;
-        char* buff = NULL;
-        if(cd->numOfRequestedBlocks > 0)
-            buff = calloc(cd->numOfRequestedBlocks * DATABLOCK, sizeof(char));
-        if(read(d->toRead, buff, sizeof(buff)) == -1)
-            errExit("read");
-        if( epoll_ctl(d->epollfd, EPOLL_CTL_DEL, cd->fd, NULL))
-            errExit("epoll_ctl 1");
-
-        if(clock_gettime(CLOCK_REALTIME, &ts)== -1)
-            errExit("clock_gettime");
+        publishBlocks(d);   //nobody waits in queue, everyone gets the same blocks
+        return;
+    }
+    if(d->size == 0)
+        return;
+    if(d->eventDriven)
+        produced = atomic_load(&d->gen->produced);  //before level, so wakeup can be too early but never too late
 
-        fprintf(stderr, "Client disconnected; TS: %ld.%ld address: %s port %d data lost %d\n", ts.tv_sec, ts.tv_nsec,
-            inet_ntoa( cd->clientAddr.sin_addr ), ntohs( cd->clientAddr.sin_port ), cd->numOfRequestedBlocks * DATABLOCK);
-        if(buff != NULL)
-            free(buff);
-        close(cd->fd);
-        free(cd);
+    lockAdmission(d);
+    int str = storageLevel(d);
+    int reserved = reservedBlocks(d);
+    //first client is served first even if later one wants less, otherwise big requests would starve
+    //(unless policy itself prefers small ones)
+    while((d->size > 0) && (str >( (reserved + firstElem(d)->numOfRequestedBlocks) * DATABLOCK)) )
+    {
+        clientParameters* cd = removeFirstElem(d);
+        if(d->stats != NULL)
+        {
+            atomic_fetch_sub_explicit(&d->stats->waiting, 1, memory_order_relaxed);
+            histAdd(&d->stats->waitInQueue, nowUs() - cd->queuedUs);
+        }
+        reserved += cd->numOfRequestedBlocks;    //io_uring backend starts sending already in admitClient
+        admitClient(d, cd);
     }
+    unlockAdmission(d);
 
-    else if( events[iter].events & EPOLLOUT )
-        operateOnClient( events, iter, d);
-                  
+    if(d->eventDriven && d->size > 0)
+        armGeneratorWakeup(d, produced + ((reserved + firstElem(d)->numOfRequestedBlocks) * DATABLOCK) + 1 - str);
 }
 
-int operateOnClient( struct epoll_event* events, int iter, dataContainer* d )
+//storage is already checked, blocks are reserved for client
+void admitClient(dataContainer* d, clientParameters* cd)
 {
-    char buff[DATABLOCK] = {0};
-    clientParameters* cd = events[iter].data.ptr;
-    
-    if(read(d->toRead, buff, sizeof(buff)) == -1)
-        errExit("read");
-     
-    if( write(cd->fd, buff, sizeof(buff) ) == -1)
-        errExit("write");    
-        
-    cd->numOfRequestedBlocks--;
-    d->numOfBlocks--;
-    if(cd->numOfRequestedBlocks == 0)
-        disconnectFromServer(cd, d);
-    else
+    if(d->negotiate && d->sim == NULL && !cd->datagram && !cd->local)
     {
-        struct epoll_event ev = {0};
-        ev.events = EPOLLOUT | EPOLLRDHUP;
-        ev.data.ptr = cd;
-        if ( epoll_ctl( d->epollfd, EPOLL_CTL_MOD, cd->fd, &ev ) == -1 ) 
-            errExit("epoll_ctl ");  
+        //goes to client before blocks, as the beginning of its pending data
+        grantHeader g = { htonl(PROTOMAGIC), htonl(cd->numOfRequestedBlocks) };
+        stashPending(cd, (char*)&g, sizeof(g));
     }
-    
-    return 0;
+    d->numOfBlocks += cd->numOfRequestedBlocks;
+    if(d->sim != NULL)
+    {
+        simAdmitted(d, cd);
+        return;
+    }
+    cd->admittedUs = cd->progressUs = d->wheel.nowUs;
+    if(cd->datagram)
+    {
+        udpSendPortion(d, cd);
+        return;
+    }
+    armClientDeadline(d, cd);
+    if(cd->local)
+        localGrantParts(d, cd);
+    else if(d->uring != NULL)
+        uringSendBlock(d, cd);
+    else
+        addClientToEpoll(d, (EPOLLOUT | EPOLLRDHUP | (d->edgeTriggered ? EPOLLET : 0)) , cd );
 }
 
-void addClientToEpoll(dataContainer* d, int flags, int fdToAdd, int checkAddr, struct sockaddr_in addr)
+/*
+unreserved data grows only when generator produces, so it is enough to be woken when
+generator reaches given amount of produced bytes
+*/
+void armGeneratorWakeup(dataContainer* d, unsigned long wakeAt)
 {
-    clientParameters* cd = calloc(1, sizeof(clientParameters));
-    cd->fd = fdToAdd;
-    cd->numOfRequestedBlocks = 4; 
-    if(checkAddr == 1) cd->clientAddr = addr;
-    d->ev.events = flags;
-    d->ev.data.ptr = cd;
-    if (epoll_ctl(d->epollfd, EPOLL_CTL_ADD, fdToAdd, &(d->ev) ) == -1) 
-        errExit("epoll_ctl ");
-
+    atomic_store(&d->gen->wakeAt[d->reactorId], wakeAt);
+    //generator could pass this value before it saw it
+    if(atomic_load(&d->gen->produced) >= wakeAt && atomic_exchange(&d->gen->wakeAt[d->reactorId], 0) != 0)
+        if(eventfd_write(d->eventfd, 1) == -1)
+            errExit("eventfd_write");
 }
 
-void placeClientInRingBuffOrEpoll(dataContainer* d, int client_sock)
+void startReactors(dataContainer* d)
 {
-    d->numOfClients++;
-    int str;
-    if( ioctl(d->toRead, FIONREAD, &str) == -1)
-        errExit("ioctl");
-        
-    if(str <( (d->numOfBlocks * DATABLOCK)  + DATAPORTION))
-        addElem(d, client_sock);
-    else
-    {   
-        int sockfd;
-        if(d->size > 0)
+    reactorGroup* g = calloc(1, sizeof(reactorGroup));
+    g->numOfReactors = d->numOfReactors;
+    pthread_mutex_init(&g->admitLock, NULL);
+    d->group = g;
+    for(int i = 0; i < g->numOfReactors; i++)
+    {
+        dataContainer* shard = d;
+        if(i > 0)
         {
-            addElem(d, client_sock);
-            sockfd = removeFirstElem(d);
+            shard = malloc(sizeof(dataContainer));
+            *shard = *d;
+            shard->reactorId = i;
+            if(d->eventDriven)
+                shard->eventfd = d->gen->eventfd[i];
         }
-        else sockfd = client_sock;
-        struct sockaddr_in addr = {0};
-        socklen_t addLen = sizeof(addr);
-        if(getpeername(sockfd, (struct sockaddr* )&addr, &addLen) == -1)
-            errExit("getpeername");
-        addClientToEpoll(d, (EPOLLOUT | EPOLLRDHUP) , sockfd, 1, addr );
-        d->numOfBlocks +=4;
+        if(d->useSplice && pipe2(shard->splicePipe, O_NONBLOCK) == -1)
+            errExit("pipe");
+        g->shards[i] = shard;
+    }
+
+    for(int i = 1; i < g->numOfReactors; i++)
+    {
+        pthread_t thread;
+        if((errno = pthread_create(&thread, NULL, reactorThread, g->shards[i])) != 0)
+            errExit("pthread_create");
+        pthread_detach(thread);
     }
 }
 
-void createSetEpoll(dataContainer* d)
+void* reactorThread(void* arg)
 {
-    if((d->epollfd = epoll_create1(0)) == -1)
-        errExit("epoll_create1");
-    
-    struct sockaddr_in addr = {0};
-    addClientToEpoll(d, EPOLLIN, d->server_fd, 0, addr );
-    addClientToEpoll(d, EPOLLIN, d->timerfd, 0, addr);    
-    d->ringBuffer = calloc(MAXCLIENTS, sizeof(int));
+    dataContainer* d = arg;
+    pinThread(pthread_self(), d->reactorCpus, d->numOfReactorCpus, d->reactorId, "reactor");
+    createServer(d);
+    createSetEpoll(d);  //report is written only by reactor 0
+    resourceDistribution(d);
+    return NULL;
 }
 
-void armTimer(dataContainer* d)
+//blocks reserved by clients of all reactors
+int reservedBlocks(dataContainer* d)
 {
-    struct itimerspec value;
-
-    value.it_value.tv_sec = 5;
-    value.it_value.tv_nsec = 0;
-
-    value.it_interval.tv_sec = 5;
-    value.it_interval.tv_nsec = 0;
+    if(d->group == NULL)
+        return d->numOfBlocks;
+    int sum = 0;
+    for(int i = 0; i < d->group->numOfReactors; i++)
+        sum += atomic_load_explicit(&d->group->shards[i]->numOfBlocks, memory_order_relaxed);
+    return sum;
+}
 
-    d->timerfd = timerfd_create(CLOCK_REALTIME, 0);    
-    if (d->timerfd == -1)        
-        errExit("timerfd_create");    
+int connectedClients(dataContainer* d)
+{
+    if(d->group == NULL)
+        return d->numOfClients;
+    int sum = 0;
+    for(int i = 0; i < d->group->numOfReactors; i++)
+        sum += atomic_load_explicit(&d->group->shards[i]->numOfClients, memory_order_relaxed);
+    return sum;
+}
 
-    if (timerfd_settime(d->timerfd, 0, &value, NULL) == -1)       
-        errExit("timerfd_settime");
+metrics* createMetrics(void)
+{
+    metrics* m = mmap(NULL, sizeof(metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED)
+        errExit("mmap");
+    m->startUs = nowUs();
+    return m;
 }
 
-void disconnectFromServer(clientParameters* cd, dataContainer* d)
+//every connection gets one JSON document and is closed, e.g. socat - UNIX-CONNECT:path
+void createMetricsSocket(dataContainer* d)
 {
-    d->numOfClients--;
-    shutdown( cd->fd, SHUT_RDWR );
-    struct timespec ts = {0};
-    if ( clock_gettime( CLOCK_REALTIME, &ts) == -1 ) 
-        errExit("clock_gettime");
-    if ( epoll_ctl( d->epollfd, EPOLL_CTL_DEL, cd->fd, NULL) == -1 )
-        errExit("epoll_ctl ");
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if(strlen(d->metricsPath) >= sizeof(addr.sun_path))
+    {
+        printf("metrics socket path is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, d->metricsPath);
+    unlink(d->metricsPath);     //left by previous run
 
-    fprintf(stderr, "TS: %ld.%ld; address: %s port %d lost packages: %d \n",ts.tv_sec, ts.tv_nsec,
-    inet_ntoa( cd->clientAddr.sin_addr ), ntohs( cd->clientAddr.sin_port ), cd->numOfRequestedBlocks);
-    free(cd);
+    if((d->metricsfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        errExit("socket");
+    if(bind(d->metricsfd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        errExit("bind");
+    if(listen(d->metricsfd, 16) == -1)
+        errExit("listen");
+    d->lastScrapeUs = d->stats->startUs;
 }
 
-void child(int toWrite, dataContainer* d)
+void sendMetrics(dataContainer* d)
 {
-    int pipeCapacity = fcntl(toWrite, F_GETPIPE_SZ);
-    int storagedInPipe = 0;
-    int onProgress = 1; 
-    struct timespec ts ={0};
-    float times = BLOCK / (RATE * d->frequency);
-    ts.tv_sec = (long)times;
-    ts.tv_nsec = (long)((times - ts.tv_sec )*1e9);
-    char c = 'a';
-    
-    while(onProgress)
+    int fd;
+    //reactor thread must not wait for scraper
+    while((fd = accept4(d->metricsfd, NULL, NULL, SOCK_NONBLOCK)) != -1)
     {
-        if( ioctl(toWrite, FIONREAD, &storagedInPipe) == -1)
-            errExit("ioctl");
-        while(pipeCapacity - storagedInPipe >= BLOCK)
+        char* buff = NULL;
+        size_t len = 0;
+        FILE* f = open_memstream(&buff, &len);
+        if(f == NULL)
+            errExit("open_memstream");
+        writeMetrics(f, d);
+        fclose(f);
+        for(size_t off = 0; off < len; )
         {
-            if( insertBlock(toWrite, c) == -1)
-            {
-                onProgress = 0;
-                break;
-            }
-            c+= 1;
-            if(c > 'z')
-                c = 'A';
-            if(c > 'Z')
-                c = 'a';
-                
-            if(nanosleep(&ts, NULL) == -1)
-                errExit("nanosleep");
-            
-        
-            if( ioctl(toWrite, FIONREAD, &storagedInPipe) == -1)
-                errExit("ioctl"); 
+            ssize_t w = send(fd, buff + off, len - off, MSG_NOSIGNAL);
+            if(w == -1 && errno == EINTR)
+                continue;
+            if(w == -1)
+                break;      //scraper went away or doesn't read, what didn't fit is dropped
+            off += w;
         }
-    } 
-   
+        free(buff);
+        close(fd);
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        errExit("accept4");
 }
 
-int insertBlock(int fdToWrite, char c)
+void writeMetrics(FILE* f, dataContainer* d)
 {
-    char producedData[BLOCK]={0}; 
-    int errorOccured = 0;
-
-    for(int i=0; i< BLOCK - 1; i++)
-        producedData[i] = c;
-    producedData[BLOCK-1]= '\0';
+    metrics* m = d->stats;
+    unsigned long now = nowUs();
+    unsigned long generated = atomic_load_explicit(&m->bytesGenerated, memory_order_relaxed);
+    int str = storageLevel(d);
+    int capacity = storageCapacity(d);
+    //rate since previous scrape, so scraping every few seconds gives current generator speed
+    double interval = (now - d->lastScrapeUs) / 1e6;
+    double rate = interval > 0 ? (generated - d->lastScrapeBytes) / interval : 0;
+    double uptime = (now - m->startUs) / 1e6;
+    d->lastScrapeUs = now;
+    d->lastScrapeBytes = generated;
 
-    if(write(fdToWrite, producedData, BLOCK)== -1)
-        if(errno == EPIPE)
-            errorOccured = -1;
+    fprintf(f, "{\"uptime\": %.3f,\n", uptime);
+    fprintf(f, " \"storage\": {\"level\": %d, \"capacity\": %d, \"fill\": %.4f, \"reserved\": %d},\n",
+        str, capacity, (double)str / capacity, reservedBlocks(d) * DATABLOCK);
+    fprintf(f, " \"clients\": {\"connected\": %d, \"waiting\": %ld, \"accepted\": %lu, \"served\": %lu, \"disconnected\": %lu, \"evicted\": %lu, \"rejected\": %lu},\n",
+        connectedClients(d), atomic_load(&m->waiting), atomic_load(&m->accepted), atomic_load(&m->served), 
+        atomic_load(&m->disconnected), atomic_load(&m->evicted), atomic_load(&m->rejected));
+    //idle client costs its record and, while it waits, one pointer in wait queue
+    unsigned long records = atomic_load(&m->records);
+    fprintf(f, " \"memory\": {\"clientRecord\": %zu, \"records\": %lu, \"recordBytes\": %lu},\n",
+        sizeof(clientParameters), records, records * sizeof(clientParameters));
+    fprintf(f, " \"blocksSent\": %lu, \"bytesLost\": %lu,\n", atomic_load(&m->blocksSent), atomic_load(&m->bytesLost));
+    fprintf(f, " \"generator\": {\"bytes\": %lu, \"rate\": %.1f, \"averageRate\": %.1f, \"expectedRate\": %.1f},\n",
+        generated, rate, uptime > 0 ? generated / uptime : 0, RATE * d->frequency);
+    fprintf(f, " \"histograms\": {\n");
+    writeHistogram(f, "waitInQueue", &m->waitInQueue, 0);
+    writeHistogram(f, "acceptToFirstByte", &m->acceptToFirstByte, 0);
+    writeHistogram(f, "blockSend", &m->blockSend, 1);
+    fprintf(f, " }\n}\n");
+}
 
-    return errorOccured;
+//percentiles are upper bounds of buckets in microseconds
+void writeHistogram(FILE* f, const char* name, histogram* h, int last)
+{
+    unsigned long count = atomic_load(&h->count);
+    fprintf(f, "  \"%s\": {\"count\": %lu, \"sumUs\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"buckets\": [",
+        name, count, atomic_load(&h->sum), histPercentile(h, 0.5), histPercentile(h, 0.9), 
+        histPercentile(h, 0.99), histPercentile(h, 0.999));
+    for(int i = 0; i < HISTBUCKETS; i++)
+        fprintf(f, "%s%lu", i ? ", " : "", atomic_load_explicit(&h->bucket[i], memory_order_relaxed));
+    fprintf(f, "]}%s\n", last ? "" : ",");
 }
 
-void parseArguments(int argc, char** argv, dataContainer* d)
+unsigned long histPercentile(histogram* h, double p)
 {
-  int opt;
-  while( (opt=getopt(argc, argv, "p:")) != -1 )
-  {
-    switch(opt)
+    unsigned long total = 0;
+    for(int i = 0; i < HISTBUCKETS; i++)
+        total += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+    if(total == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(p * total);
+    unsigned long seen = 0;
+    for(int i = 0; i < HISTBUCKETS; i++)
     {
-      case 'p':
-            d->frequency = parseFloat(optarg);
-            break;
-     
-      default:
-            printf("Wrong parameters!\n");
-            exit(EXIT_FAILURE);
+        seen += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+        if(seen > rank)
+            return 1UL << i;
+    }
+    return 1UL << (HISTBUCKETS - 1);
+}
+
+void histAdd(histogram* h, unsigned long us)
+{
+    int i = us == 0 ? 0 : 64 - __builtin_clzl(us);
+    if(i >= HISTBUCKETS)
+        i = HISTBUCKETS - 1;
+    atomic_fetch_add_explicit(&h->bucket[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+void countStat(_Atomic unsigned long* counter, unsigned long value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+unsigned long nowUs(void)
+{
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        errExit("clock_gettime");
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void recordSendStart(dataContainer* d, clientParameters* cd, int blocks)
+{
+    if(d->stats == NULL)
+        return;
+    cd->sendStartUs = nowUs();
+    cd->sendBlocks = blocks;
+    countStat(&d->stats->blocksSent, blocks);
+    if(!cd->firstByteSent)
+    {
+        cd->firstByteSent = 1;
+        histAdd(&d->stats->acceptToFirstByte, cd->sendStartUs - cd->acceptedUs);
+    }
+}
+
+//every block of the batch gets the time of the whole batch
+void recordBlockSent(dataContainer* d, clientParameters* cd)
+{
+    if(d->stats == NULL || cd->sendStartUs == 0)
+        return;     //grant header is not a block
+    unsigned long us = nowUs() - cd->sendStartUs;
+    for(int i = 0; i < cd->sendBlocks; i++)
+        histAdd(&d->stats->blockSend, us);
+    cd->sendStartUs = 0;
+}
+
+int deadlinesEnabled(dataContainer* d)
+{
+    //datagram clients linger on the wheel after their portion is sent, local ones hold parts only so long
+    return d->idleTimeout > 0 || d->portionTimeout > 0 || d->waitTimeout > 0 || d->datagrams || d->localPath != NULL;
+}
+
+void wheelInit(timingWheel* w)
+{
+    memset(w, 0, sizeof(timingWheel));
+    w->startUs = w->nowUs = nowUs();
+    for(int l = 0; l < WHEELLEVELS; l++)
+        for(int s = 0; s < WHEELSIZE; s++)
+            w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+}
+
+//level is chosen by distance from now, so timer is in the slot wheel reaches before its time
+void wheelPlace(timingWheel* w, wheelTimer* t)
+{
+    unsigned long delta = t->expires - w->now;
+    int level = 0;
+    while(level < WHEELLEVELS - 1 && delta >= (1UL << (WHEELBITS * (level + 1))))
+        level++;
+    if(delta >= (1UL << (WHEELBITS * WHEELLEVELS)))
+        t->expires = w->now + (1UL << (WHEELBITS * WHEELLEVELS)) - 1;    //further than wheel reaches
+    wheelTimer* head = &w->slots[level][(t->expires >> (WHEELBITS * level)) & (WHEELSIZE - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+//armed timer is moved, so every client has at most one deadline in wheel
+void wheelAdd(timingWheel* w, wheelTimer* t, unsigned long expiresUs)
+{
+    wheelCancel(w, t);
+    unsigned long expires = expiresUs > w->startUs ? (expiresUs - w->startUs + WHEELTICK - 1) / WHEELTICK : 0;
+    t->expires = expires > w->now ? expires : w->now + 1;
+    wheelPlace(w, t);
+    w->count++;
+}
+
+void wheelCancel(timingWheel* w, wheelTimer* t)
+{
+    if(t->next == NULL)
+        return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    w->count--;
+}
+
+/*
+moves wheel to current time, timers of every passed tick are checked,
+returns number of evicted clients
+*/
+int wheelAdvance(dataContainer* d)
+{
+    if(!deadlinesEnabled(d))
+        return 0;
+    timingWheel* w = &d->wheel;
+    w->nowUs = nowUs();
+    unsigned long target = (w->nowUs - w->startUs) / WHEELTICK;
+    if(w->count == 0)
+    {
+        w->now = target;    //nothing to check on the way
+        return 0;
+    }
+
+    int evicted = 0;
+    while(w->now < target)
+    {
+        w->now++;
+        //when lower level wraps, next slot of higher level goes down
+        for(int l = 1; l < WHEELLEVELS; l++)
+        {
+            if(((w->now >> (WHEELBITS * (l - 1))) & (WHEELSIZE - 1)) != 0)
+                break;
+            wheelTimer* head = &w->slots[l][(w->now >> (WHEELBITS * l)) & (WHEELSIZE - 1)];
+            while(head->next != head)
+            {
+                wheelTimer* t = head->next;
+                t->prev->next = t->next;
+                t->next->prev = t->prev;
+                wheelPlace(w, t);
+            }
+        }
+
+        //expired list is taken out first, handlers re-arm and cancel timers
+        wheelTimer* head = &w->slots[0][w->now & (WHEELSIZE - 1)];
+        if(head->next == head)
+            continue;
+        wheelTimer expired = { head->next, head->prev, 0 };
+        expired.next->prev = expired.prev->next = &expired;
+        head->next = head->prev = head;
+        while(expired.next != &expired)
+        {
+            wheelTimer* t = expired.next;
+            wheelCancel(w, t);
+            clientParameters* cd = (clientParameters*)((char*)t - offsetof(clientParameters, timer));
+            int type = clientExpired(d, cd);
+            if(type != 0)
+            {
+                evictClient(d, cd, type);
+                evicted++;
+            }
+        }
+    }
+    return evicted;
+}
+
+//the earliest deadline of client in its current state
+void armClientDeadline(dataContainer* d, clientParameters* cd)
+{
+    unsigned long at = 0;
+    if(cd->queueIndex >= 0)
+    {
+        if(d->waitTimeout > 0)
+            at = d->wheel.nowUs + d->waitTimeout * 1000UL;
+    }
+    else if(cd->datagram)
+        at = cd->progressUs + UDPLINGER * 1000UL;
+    else
+    {
+        if(d->idleTimeout > 0)
+            at = cd->progressUs + d->idleTimeout * 1000UL;
+        if(!cd->readingHeader && d->portionTimeout > 0)
+        {
+            unsigned long end = cd->admittedUs + d->portionTimeout * 1000UL;
+            if(at == 0 || end < at)
+                at = end;
+        }
+        if(cd->localCount > 0 && (at == 0 || cd->admittedUs + LOCALHOLD * 1000UL < at))
+            at = cd->admittedUs + LOCALHOLD * 1000UL;
+    }
+    if(at == 0)
+        wheelCancel(&d->wheel, &cd->timer);
+    else
+        wheelAdd(&d->wheel, &cd->timer, at);
+}
+
+/*
+progress only stamps client, so timer is not moved on every send;
+when it fires the real deadline is checked and timer is armed again if client moved meanwhile
+*/
+int clientExpired(dataContainer* d, clientParameters* cd)
+{
+    unsigned long now = d->wheel.nowUs;
+    if(cd->queueIndex >= 0)
+        return LOG_WAITEXPIRED;
+    if(cd->datagram && now - cd->progressUs >= UDPLINGER * 1000UL)
+        disconnectFromServer(cd, d);    //nobody asks for resends any more
+    else if(cd->datagram)
+        armClientDeadline(d, cd);
+    if(cd->datagram)
+        return 0;
+    if(cd->localCount > 0 && now - cd->admittedUs >= LOCALHOLD * 1000UL)
+    {
+        clientLost(d, cd);  //its parts are given back, storage can't wait for it
+        return 0;
+    }
+    if(!cd->readingHeader && d->portionTimeout > 0 && now - cd->admittedUs >= d->portionTimeout * 1000UL)
+        return LOG_TOOSLOW;
+    if(d->idleTimeout > 0 && now - cd->progressUs >= d->idleTimeout * 1000UL)
+        return LOG_IDLE;
+    armClientDeadline(d, cd);
+    return 0;
+}
+
+//blocks not yet sent stay in storage for other clients, only partly sent block is lost
+void evictClient(dataContainer* d, clientParameters* cd, int type)
+{
+    int blocks = 0;
+    if(cd->queueIndex >= 0)
+    {
+        removeElem(d, cd->queueIndex);
+        d->numOfClients--;
+        if(d->stats != NULL)
+            atomic_fetch_sub_explicit(&d->stats->waiting, 1, memory_order_relaxed);
+    }
+    else if(!cd->readingHeader)
+    {
+        if(cd->subIndex >= 0)
+            unsubscribe(d, cd);
+        blocks = cd->numOfRequestedBlocks;
+        d->numOfClients--;
+        d->numOfBlocks -= blocks;
+        if(d->stats != NULL)
+            countStat(&d->stats->bytesLost, cd->pendingLen - cd->pendingOff);
+    }
+    if(d->stats != NULL)
+        countStat(&d->stats->evicted, 1);
+    logRecord* rec = logBegin(d, type, cd);
+    if(rec != NULL)
+    {
+        rec->lost = blocks;
+        logCommit(d);
+    }
+    closeClient(d, cd);
+}
+
+//logger is started before reactors, every reactor takes its ring in createSetEpoll
+eventLogger* createLogger(dataContainer* d)
+{
+    eventLogger* lg = calloc(1, sizeof(eventLogger));
+    if(lg == NULL)
+        errExit("calloc");
+    lg->numOfRings = d->numOfReactors > 1 ? d->numOfReactors : 1;
+    lg->overwrite = d->logOverwrite;
+    lg->outfd = -1;
+    if(d->logPath != NULL && (lg->outfd = open(d->logPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1)
+        errExit("open");
+    if((lg->rings = aligned_alloc(64, lg->numOfRings * sizeof(eventLog))) == NULL)
+        errExit("aligned_alloc");
+    for(int i = 0; i < lg->numOfRings; i++)
+    {
+        atomic_init(&lg->rings[i].head, 0);
+        atomic_init(&lg->rings[i].tail, 0);
+    }
+    pthread_t thread;
+    if((errno = pthread_create(&thread, NULL, loggerThread, lg)) != 0)
+        errExit("pthread_create");
+    pthread_detach(thread);
+    return lg;
+}
+
+//formatting and writing happen here, so slow stderr never stops distribution
+void* loggerThread(void* arg)
+{
+    eventLogger* lg = arg;
+    struct timespec idle = { 0, LOGIDLE };
+    unsigned long reported = 0;
+    logRecord rec;
+    while(1)
+    {
+        int taken = 0;
+        for(int i = 0; i < lg->numOfRings; i++)
+            while(logTake(&lg->rings[i], &rec))
+            {
+                taken++;
+                if(lg->outfd == -1)
+                    printRecord(&rec);
+                else if(write(lg->outfd, &rec, sizeof(rec)) != sizeof(rec))
+                    errExit("write");
+            }
+
+        unsigned long dropped = atomic_load_explicit(&lg->dropped, memory_order_relaxed);
+        if(dropped != reported)
+        {
+            fprintf(stderr, "event log: %lu records lost, ring was full\n", dropped - reported);
+            reported = dropped;
+        }
+        if(taken == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/*
+returns place for record, which is published by logCommit, or NULL when it has to be dropped.
+clock_gettime goes through vDSO, it is the only call made by reactor
+*/
+logRecord* logBegin(dataContainer* d, int type, clientParameters* cd)
+{
+    eventLog* l = d->log;
+    eventLogger* lg = d->logger;
+    unsigned long head = atomic_load_explicit(&l->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&l->tail, memory_order_acquire);
+    while(head - tail >= LOGRECORDS)
+    {
+        atomic_fetch_add_explicit(&lg->dropped, 1, memory_order_relaxed);
+        if(!lg->overwrite)
+            return NULL;
+        //take the oldest record from logger, it fails only when logger has just taken it
+        if(atomic_compare_exchange_weak_explicit(&l->tail, &tail, tail + 1, memory_order_acq_rel, memory_order_acquire))
+            break;
+        atomic_fetch_sub_explicit(&lg->dropped, 1, memory_order_relaxed);
+    }
+
+    logRecord* rec = &l->records[head % LOGRECORDS];
+    memset(rec, 0, sizeof(logRecord));
+    if(clock_gettime(CLOCK_REALTIME, &rec->ts) == -1)
+        errExit("clock_gettime");
+    rec->type = type;
+    if(cd != NULL)
+    {
+        rec->addr = cd->clientAddr.sin_addr.s_addr;
+        rec->port = ntohs(cd->clientAddr.sin_port);
+    }
+    return rec;
+}
+
+void logCommit(dataContainer* d)
+{
+    atomic_store_explicit(&d->log->head, atomic_load_explicit(&d->log->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/*
+copy is made before tail is moved; if reactor overwrote this record meanwhile, 
+it has moved tail first, so our CAS fails and the copy is thrown away
+*/
+int logTake(eventLog* l, logRecord* rec)
+{
+    unsigned long tail = atomic_load_explicit(&l->tail, memory_order_acquire);
+    while(tail != atomic_load_explicit(&l->head, memory_order_acquire))
+    {
+        memcpy(rec, &l->records[tail % LOGRECORDS], sizeof(logRecord));
+        if(atomic_compare_exchange_strong_explicit(&l->tail, &tail, tail + 1, memory_order_acq_rel, memory_order_acquire))
+            return 1;
+    }
+    return 0;
+}
+
+//the same text which was printed before by reactor
+void printRecord(logRecord* rec)
+{
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &rec->addr, addr, sizeof(addr));
+    switch(rec->type)
+    {
+    case LOG_REPORT:
+        fprintf(stderr, "TS: %ld.%ld bytes in storage: %d,  %.2f%%; number of connected clients %d flow %d\n",
+            rec->ts.tv_sec, rec->ts.tv_nsec, rec->level, ( ( (float)rec->level )/( (float)rec->capacity ) )*100, 
+            rec->clients, rec->flow);
+        break;
+    case LOG_DISCONNECTED:
+        fprintf(stderr, "Client disconnected; TS: %ld.%ld address: %s port %d data lost %d\n", 
+            rec->ts.tv_sec, rec->ts.tv_nsec, addr, rec->port, rec->lost);
+        break;
+    case LOG_SERVED:
+        fprintf(stderr, "TS: %ld.%ld; address: %s port %d lost packages: %d \n",
+            rec->ts.tv_sec, rec->ts.tv_nsec, addr, rec->port, rec->lost);
+        break;
+    case LOG_WAITEXPIRED:
+    case LOG_IDLE:
+    case LOG_TOOSLOW:
+    case LOG_LAGGING:
+        fprintf(stderr, "Client evicted: %s; TS: %ld.%ld address: %s port %d blocks returned %d\n",
+            rec->type == LOG_WAITEXPIRED ? "waited too long" : rec->type == LOG_IDLE ? "idle" : 
+            rec->type == LOG_LAGGING ? "too far behind broadcast" : "portion too slow",
+            rec->ts.tv_sec, rec->ts.tv_nsec, addr, rec->port, rec->lost);
+        break;
+    case LOG_REJECTED:
+        fprintf(stderr, "Client rejected: limit of %d connections; TS: %ld.%ld address: %s port %d\n",
+            rec->clients, rec->ts.tv_sec, rec->ts.tv_nsec, addr, rec->port);
+        break;
+    case LOG_JITTER:
+        fprintf(stderr, "TS: %ld.%ld generator wakes up late p50 %d us p99 %d us max %d us; report timer late %d us\n",
+            rec->ts.tv_sec, rec->ts.tv_nsec, rec->level, rec->capacity, rec->clients, rec->flow);
+        break;
+    case LOG_PAUSED:
+        fprintf(stderr, "TS: %ld.%ld accepting paused with %d connections\n",
+            rec->ts.tv_sec, rec->ts.tv_nsec, rec->clients);
+        break;
+    case LOG_NOREQUEST:
+    case LOG_BADREQUEST:
+        fprintf(stderr, "Client dropped: %s; address: %s port %d\n", 
+            rec->type == LOG_NOREQUEST ? "disconnected before request" : "wrong request", addr, rec->port);
+        break;
+    }
+}
+
+/*
+io_uring backend: accept, sends and timers are submitted to kernel and many of them are
+finished in one io_uring_enter. Every admitted client has one block in flight, read from
+pipe and sent in linked operations, so nobody waits for readiness and nothing is rearmed
+in epoll. Returns -1 when kernel has no io_uring, then epoll is used
+*/
+int uringSetup(dataContainer* d)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URINGENTRIES, &p);
+    if(fd == -1)
+    {
+        perror("io_uring_setup, using epoll");
+        return -1;
+    }
+    //linked read and send rely on skipped completions, older kernel would fail them with EINVAL
+    if(!(p.features & IORING_FEAT_CQE_SKIP))
+    {
+        fprintf(stderr, "io_uring can't skip completions, using epoll\n");
+        close(fd);
+        return -1;
+    }
+    uringState* u = calloc(1, sizeof(uringState));
+    if(u == NULL)
+        errExit("calloc");
+    u->fd = fd;
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if((p.features & IORING_FEAT_SINGLE_MMAP) && cqSize > sqSize)
+        sqSize = cqSize;
+    char* sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED)
+        errExit("mmap");
+    char* cq = sq;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) &&
+        (cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        errExit("mmap");
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED)
+        errExit("mmap");
+
+    u->sqHead = (unsigned*)(sq + p.sq_off.head);
+    u->sqTail = (unsigned*)(sq + p.sq_off.tail);
+    u->sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sqEntries = (unsigned*)(sq + p.sq_off.ring_entries);
+    u->sqArray = (unsigned*)(sq + p.sq_off.array);
+    u->cqHead = (unsigned*)(cq + p.cq_off.head);
+    u->cqTail = (unsigned*)(cq + p.cq_off.tail);
+    u->cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    u->tick.tv_nsec = URINGTICK;
+    u->report.tv_sec = REPORTPERIOD;
+    u->retry.tv_nsec = ACCEPTRETRY * 1000000L;
+    d->uring = u;
+
+    //io_uring waits for connections itself, nonblocking socket would only give it EAGAIN
+    if(fcntl(d->server_fd, F_SETFL, fcntl(d->server_fd, F_GETFL) & ~O_NONBLOCK) == -1)
+        errExit("fcntl");
+    createClientStructures(d);
+    uringArmAccept(d);
+    uringArmTimeout(d, URING_REPORT, &u->report);
+    if(d->eventDriven)
+        uringArmPoll(d, URING_EVENTFD, d->eventfd);
+    else
+        uringArmTimeout(d, URING_TICK, &u->tick);
+    if(d->stats != NULL)
+        uringArmPoll(d, URING_METRICS, d->metricsfd);
+    return 0;
+}
+
+void uringLoop(dataContainer* d)
+{
+    uringState* u = d->uring;
+    while(1)
+    {
+        uringEnter(d, 1);
+        unsigned head = *u->cqHead;
+        while(head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = u->cqes[head & *u->cqMask];
+            __atomic_store_n(u->cqHead, ++head, __ATOMIC_RELEASE);    //handler can submit, slot is not needed
+            uringHandle(d, &cqe);
+        }
+    }
+}
+
+void uringHandle(dataContainer* d, struct io_uring_cqe* cqe)
+{
+    uringState* u = d->uring;
+    int op = cqe->user_data & 7;
+    clientParameters* cd = (clientParameters*)(uintptr_t)(cqe->user_data & ~(uint64_t)7);
+    int more = cqe->flags & IORING_CQE_F_MORE;   //multishot operation stays armed
+
+    switch(op)
+    {
+    case URING_ACCEPT:
+        if(!more)
+            u->acceptArmed = 0;
+        if(cqe->res >= 0 && d->connections >= d->maxConnections)
+        {
+            //accepted before cancel of accept took effect, it can't go back to backlog
+            struct sockaddr_in addr = {0};
+            socklen_t c = sizeof(struct sockaddr_in);
+            getpeername(cqe->res, (struct sockaddr *)&addr, &c);
+            rejectClient(d, cqe->res, &addr);
+        }
+        else if(cqe->res >= 0)
+        {
+            d->connections++;
+            cd = allocClient(d);
+            cd->fd = cqe->res;
+            if(d->busyPoll > 0)
+                setBusyPoll(&d->busyPoll, cd->fd);
+            socklen_t c = sizeof(struct sockaddr_in);
+            getpeername(cd->fd, (struct sockaddr *)&cd->clientAddr, &c);
+            if(d->stats != NULL)
+            {
+                countStat(&d->stats->accepted, 1);
+                cd->acceptedUs = nowUs();
+            }
+            cd->numOfRequestedBlocks = 4;
+            placeClientInRingBuffOrEpoll(d, cd);
+        }
+        else if(cqe->res == -EINVAL && !u->singleAccept)
+        {
+            fprintf(stderr, "io_uring has no multishot accept, accepting one by one\n");
+            u->singleAccept = 1;
+        }
+        else if(cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM)
+            pauseAccepting(d, PAUSE_RESOURCES);  //accept is armed again by tick
+        else if(cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN && cqe->res != -ECANCELED)
+        {
+            errno = -cqe->res;
+            errExit("io_uring accept");
+        }
+        if(d->connections >= d->maxConnections && !d->rejectOverLimit)
+            pauseAccepting(d, PAUSE_LIMIT);
+        if(!u->acceptArmed && !d->acceptPaused)
+            uringArmAccept(d);
+        break;
+    case URING_REPORT:
+        reportStorage(d, connectedClients(d));
+        if(d->jitter != NULL)
+            reportJitter(d);
+        uringArmTimeout(d, URING_REPORT, &u->report);
+        break;
+    case URING_TICK:
+        admitWaitingClients(d);
+        retryAccepting(d);
+        if(!d->eventDriven)
+            uringArmTimeout(d, URING_TICK, &u->tick);
+        else if(d->acceptPaused == PAUSE_RESOURCES)
+            uringArmTimeout(d, URING_TICK, &u->retry);  //only to try accept again
+        break;
+    case URING_EVENTFD:
+    {
+        eventfd_t val;
+        if(eventfd_read(d->eventfd, &val) == -1 && errno != EAGAIN)
+            errExit("eventfd_read");
+        admitWaitingClients(d);
+        if(!more)
+            uringArmPoll(d, URING_EVENTFD, d->eventfd);
+        break;
+    }
+    case URING_METRICS:
+        sendMetrics(d);
+        if(!more)
+            uringArmPoll(d, URING_METRICS, d->metricsfd);
+        break;
+    case URING_READ:
+        //reservation guarantees data in pipe, so error is never expected
+        if(cqe->res < 0)
+        {
+            errno = -cqe->res;
+            errExit("io_uring read");
+        }
+        //short read broke the link, rest of block is read here and cancelled send is queued again
+        for(int got = cqe->res; got < DATABLOCK; )
+        {
+            ssize_t r = read(d->toRead, cd->pending + got, DATABLOCK - got);
+            if(r == -1 && errno == EINTR)
+                continue;
+            if(r <= 0)
+                errExit("read");
+            got += r;
+        }
+        cd->readPending = 2;
+        break;
+    case URING_SEND:
+        uringSendDone(d, cd, cqe->res);
+        break;
+    }
+}
+
+struct io_uring_sqe* uringSqe(dataContainer* d, int op, uint64_t data)
+{
+    uringState* u = d->uring;
+    unsigned tail = *u->sqTail;
+    //queue is full, kernel takes everything without waiting, its slots are free only after that
+    while(tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) == *u->sqEntries)
+    {
+        if(uringEnter(d, 0) != -1)
+            continue;
+        if(errno == EBUSY)
+            errExit("io_uring_enter, completion queue overflow");
+        sched_yield();
+    }
+    unsigned idx = tail & *u->sqMask;
+    struct io_uring_sqe* sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->user_data = data;
+    u->sqArray[idx] = idx;
+    __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+    u->toSubmit++;
+    return sqe;
+}
+
+//submits everything queued, with wait it also sleeps until at least one operation is finished
+int uringEnter(dataContainer* d, int wait)
+{
+    uringState* u = d->uring;
+    int ret = syscall(__NR_io_uring_enter, u->fd, u->toSubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(ret == -1)
+    {
+        if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return -1;     //completions are handled first, submission is repeated in next loop
+        errExit("io_uring_enter");
+    }
+    u->toSubmit -= ret;
+    return ret;
+}
+
+//one submission gives every next connection
+void uringArmAccept(dataContainer* d)
+{
+    d->uring->acceptArmed = 1;
+    struct io_uring_sqe* sqe = uringSqe(d, IORING_OP_ACCEPT, URING_ACCEPT);
+    sqe->fd = d->server_fd;
+    if(!d->uring->singleAccept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uringArmTimeout(dataContainer* d, int op, struct __kernel_timespec* ts)
+{
+    struct io_uring_sqe* sqe = uringSqe(d, IORING_OP_TIMEOUT, op);
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+}
+
+void uringArmPoll(dataContainer* d, int op, int fd)
+{
+    struct io_uring_sqe* sqe = uringSqe(d, IORING_OP_POLL_ADD, op);
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/*
+block is copied out of the ring at once, because places in ring are given back in order of claims
+and sends finish in any order. From pipe it is read by kernel just before send in linked operation,
+success of read gives no completion
+*/
+void uringSendBlock(dataContainer* d, clientParameters* cd)
+{
+    if(cd->pendingCap < DATABLOCK)
+    {
+        cd->pendingCap = DATABLOCK;
+        if((cd->pending = realloc(cd->pending, cd->pendingCap)) == NULL)
+            errExit("realloc");
+    }
+    recordSendStart(d, cd, 1);
+    if(d->useRing)
+    {
+        storageCopy(d, cd->pending, DATABLOCK);
+        if(d->integrity)
+            sealBlock(cd->pending, cd->blockSeq++);
+        d->numOfBlocks--;
+    }
+    else
+    {
+        struct io_uring_sqe* sqe = uringSqe(d, IORING_OP_READ, (uintptr_t)cd | URING_READ);
+        sqe->fd = d->toRead;
+        sqe->addr = (uintptr_t)cd->pending;
+        sqe->len = DATABLOCK;
+        sqe->off = -1;  //pipe has no position
+        sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        cd->readPending = 1;
+    }
+    cd->pendingLen = DATABLOCK;
+    cd->pendingOff = 0;
+    cd->numOfRequestedBlocks--;
+    uringQueueSend(d, cd);
+}
+
+void uringQueueSend(dataContainer* d, clientParameters* cd)
+{
+    struct io_uring_sqe* sqe = uringSqe(d, IORING_OP_SEND, (uintptr_t)cd | URING_SEND);
+    sqe->fd = cd->fd;
+    sqe->addr = (uintptr_t)(cd->pending + cd->pendingOff);
+    sqe->len = cd->pendingLen - cd->pendingOff;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+}
+
+void uringSendDone(dataContainer* d, clientParameters* cd, int res)
+{
+    //block reserved for client is counted until its read from pipe is surely finished
+    if(cd->readPending)
+    {
+        d->numOfBlocks--;
+        //block was completed after short read, send cancelled with link is submitted alone
+        if(cd->readPending == 2 && res == -ECANCELED)
+        {
+            cd->readPending = 0;
+            uringQueueSend(d, cd);
+            return;
+        }
+        cd->readPending = 0;
+    }
+    if(res == -EINTR || res == -EAGAIN)
+        res = 0;
+    if(res < 0)
+    {
+        clientLost(d, cd);
+        return;
+    }
+    cd->pendingOff += res;
+    if(cd->pendingOff < cd->pendingLen)
+    {
+        uringQueueSend(d, cd);
+        return;
+    }
+    recordBlockSent(d, cd);
+    cd->pendingLen = cd->pendingOff = 0;
+    if(cd->numOfRequestedBlocks == 0)
+        disconnectFromServer(cd, d);
+    else
+        uringSendBlock(d, cd);
+}
+
+void lockAdmission(dataContainer* d)
+{
+    if(d->group != NULL && (errno = pthread_mutex_lock(&d->group->admitLock)) != 0)
+        errExit("pthread_mutex_lock");
+}
+
+void unlockAdmission(dataContainer* d)
+{
+    if(d->group != NULL && (errno = pthread_mutex_unlock(&d->group->admitLock)) != 0)
+        errExit("pthread_mutex_unlock");
+}
+
+/*
+datagram transport: request is one datagram with requestHeader, it goes through wait queue
+like TCP client, identified by its address. The first answer is only a cookie, request which
+brings it back proves the address is not spoofed. When admitted, whole portion is sent at once
+and kept until client says it has everything or UDPLINGER passes, so lost blocks can be resent
+*/
+void readDatagrams(dataContainer* d)
+{
+    char bufs[UDPBATCH][sizeof(requestHeader) + sizeof(uint32_t) + UDPMAXRESEND * sizeof(uint32_t)];
+    struct sockaddr_in addrs[UDPBATCH];
+    struct iovec iov[UDPBATCH];
+    struct mmsghdr msgs[UDPBATCH];
+    int n;
+    do
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < UDPBATCH; i++)
+        {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        if((n = recvmmsg(d->udpfd, msgs, UDPBATCH, MSG_DONTWAIT, NULL)) == -1)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+                return;
+            errExit("recvmmsg");
+        }
+        for(int i = 0; i < n; i++)
+            handleDatagram(d, bufs[i], msgs[i].msg_len, &addrs[i]);
+    }while(n == UDPBATCH);
+}
+
+void handleDatagram(dataContainer* d, const char* buf, int len, struct sockaddr_in* addr)
+{
+    requestHeader h;
+    uint32_t cookie;
+    if(len < (int)(sizeof(h) + sizeof(cookie)))
+        return;
+    memcpy(&h, buf, sizeof(h));
+    memcpy(&cookie, buf + sizeof(h), sizeof(cookie));
+    cookie = ntohl(cookie);
+    buf += sizeof(h) + sizeof(cookie);
+    len -= sizeof(h) + sizeof(cookie);
+    int blocks = ntohl(h.blocks);
+    int flags = ntohl(h.flags);
+    if(ntohl(h.magic) != PROTOMAGIC || blocks < 0)
+        return;
+    clientParameters* cd = udpFind(d, addr);
+    if(cd != NULL && cookie != cd->udpCookie)
+        return;     //not from address it claims
+    if(cd != NULL)
+        cd->progressUs = d->wheel.nowUs;
+    if(flags & REQ_DONE)
+    {
+        if(cd != NULL && cd->udpBlocks > 0)
+            disconnectFromServer(cd, d);
+    }
+    else if(flags & REQ_RESEND)
+    {
+        if(cd == NULL || cd->udpBlocks == 0)
+            return;
+        if(blocks > len / (int)sizeof(uint32_t))
+            blocks = len / (int)sizeof(uint32_t);
+        uint32_t which[UDPMAXRESEND];
+        memcpy(which, buf, blocks * sizeof(uint32_t));
+        udpSendBlocks(d, cd, which, udpResendCredit(d, cd, blocks));
+    }
+    else if(cd != NULL)
+    {
+        if(cd->udpBlocks > 0)   //repeated request, everything was lost
+            udpSendBlocks(d, cd, NULL, udpResendCredit(d, cd, cd->udpBlocks));
+    }
+    else if(blocks > 0)
+    {
+        unsigned long period = d->wheel.nowUs / (UDPCOOKIEPERIOD * 1000UL);
+        if(cookie != udpCookie(d, addr, period) && cookie != udpCookie(d, addr, period - 1))
+        {
+            //answer is smaller than request, spoofed address can't be flooded through us
+            udpControl(d, addr, UDPCOOKIE, udpCookie(d, addr, period));
+            return;
+        }
+        if(d->connections >= d->maxConnections)
+        {
+            //without -R client asks again later, like connection left in backlog
+            if(d->rejectOverLimit)
+                rejectClient(d, -1, addr);
+            return;
+        }
+        d->connections++;
+        cd = allocClient(d);
+        cd->datagram = 1;
+        cd->fd = d->udpfd;
+        cd->clientAddr = *addr;
+        cd->udpCookie = cookie;
+        int maxBlocks = (storageUsable(d) - 1) / DATABLOCK;
+        cd->numOfRequestedBlocks = blocks < maxBlocks ? blocks : maxBlocks;
+        cd->deadlineMs = ntohl(h.deadlineMs);
+        cd->progressUs = d->wheel.nowUs;
+        unsigned b = (addr->sin_addr.s_addr ^ addr->sin_port * 2654435761U) % UDPBUCKETS;
+        cd->udpNext = d->udpBuckets[b];
+        d->udpBuckets[b] = cd;
+        if(d->stats != NULL)
+        {
+            countStat(&d->stats->accepted, 1);
+            cd->acceptedUs = nowUs();
+        }
+        placeClientInRingBuffOrEpoll(d, cd);
+    }
+}
+
+//blocks are taken out of storage now, so reservation ends here
+void udpSendPortion(dataContainer* d, clientParameters* cd)
+{
+    int blocks = cd->numOfRequestedBlocks;
+    if(cd->pendingCap < blocks * DATABLOCK)
+    {
+        cd->pendingCap = blocks * DATABLOCK;
+        if((cd->pending = realloc(cd->pending, cd->pendingCap)) == NULL)
+            errExit("realloc");
+    }
+    recordSendStart(d, cd, blocks);
+    for(int i = 0; i < blocks; i += SENDBATCH)
+        storageCopy(d, cd->pending + i * DATABLOCK, (blocks - i < SENDBATCH ? blocks - i : SENDBATCH) * DATABLOCK);
+    if(d->integrity)
+        for(int i = 0; i < blocks; i++)
+            sealBlock(cd->pending + i * DATABLOCK, cd->blockSeq++);
+    d->numOfBlocks -= blocks;
+    cd->numOfRequestedBlocks = 0;
+    cd->udpBlocks = blocks;
+    cd->udpCredit = blocks;
+    cd->udpCreditUs = d->wheel.nowUs;
+    udpSendBlocks(d, cd, NULL, blocks);
+    recordBlockSent(d, cd);
+    armClientDeadline(d, cd);
+}
+
+//which NULL - blocks from 0 to count; datagrams which don't fit into socket are lost like any other
+void udpSendBlocks(dataContainer* d, clientParameters* cd, const uint32_t* which, int count)
+{
+    datagramHeader hdr[UDPBATCH];
+    struct iovec iov[UDPBATCH][2];
+    struct mmsghdr msgs[UDPBATCH];
+    for(int done = 0; done < count; )
+    {
+        int n = 0;
+        memset(msgs, 0, sizeof(msgs));
+        for(; n < UDPBATCH && done + n < count; n++)
+        {
+            uint32_t idx = which == NULL ? (uint32_t)(done + n) : ntohl(which[done + n]);
+            if(idx >= (uint32_t)cd->udpBlocks)
+                idx = 0;    //nonsense from client, block 0 costs nothing more
+            hdr[n].magic = htonl(PROTOMAGIC);
+            hdr[n].index = htonl(idx);
+            hdr[n].blocks = htonl(cd->udpBlocks);
+            iov[n][0].iov_base = &hdr[n];
+            iov[n][0].iov_len = sizeof(datagramHeader);
+            iov[n][1].iov_base = cd->pending + idx * DATABLOCK;
+            iov[n][1].iov_len = DATABLOCK;
+            msgs[n].msg_hdr.msg_iov = iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 2;
+            msgs[n].msg_hdr.msg_name = &cd->clientAddr;
+            msgs[n].msg_hdr.msg_namelen = sizeof(cd->clientAddr);
+        }
+        int w = sendmmsg(d->udpfd, msgs, n, 0);
+        if(w == -1 && errno != EAGAIN && errno != EINTR && errno != ENOBUFS)
+            errExit("sendmmsg");
+        if(w <= 0)
+            return;     //client asks for the rest
+        done += w;
+    }
+}
+
+clientParameters* udpFind(dataContainer* d, struct sockaddr_in* addr)
+{
+    unsigned b = (addr->sin_addr.s_addr ^ addr->sin_port * 2654435761U) % UDPBUCKETS;
+    for(clientParameters* cd = d->udpBuckets[b]; cd != NULL; cd = cd->udpNext)
+        if(cd->clientAddr.sin_addr.s_addr == addr->sin_addr.s_addr && cd->clientAddr.sin_port == addr->sin_port)
+            return cd;
+    return NULL;
+}
+
+//keyed hash of address and period, client proves by it that it receives what is sent to that address
+uint32_t udpCookie(dataContainer* d, struct sockaddr_in* addr, unsigned long period)
+{
+    uint64_t x = d->udpSecret ^ ((uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port);
+    for(int i = 0; i < 2; i++)
+    {
+        x ^= period * 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        x ^= d->udpSecret;
+    }
+    return (uint32_t)x | 1;     //0 means client has no cookie
+}
+
+//datagramHeader alone, lost one is sent again when client repeats request
+void udpControl(dataContainer* d, struct sockaddr_in* addr, uint32_t index, uint32_t blocks)
+{
+    datagramHeader h = { htonl(PROTOMAGIC), htonl(index), htonl(blocks) };
+    sendto(d->udpfd, &h, sizeof(h), MSG_DONTWAIT, (struct sockaddr*)addr, sizeof(*addr));
+}
+
+//client gets its portion again at most UDPRESENDRATE times per second, however often it asks
+int udpResendCredit(dataContainer* d, clientParameters* cd, int count)
+{
+    cd->udpCredit += (d->wheel.nowUs - cd->udpCreditUs) / 1e6 * UDPRESENDRATE * cd->udpBlocks;
+    if(cd->udpCredit > cd->udpBlocks)
+        cd->udpCredit = cd->udpBlocks;
+    cd->udpCreditUs = d->wheel.nowUs;
+    if(count > (int)cd->udpCredit)
+        count = (int)cd->udpCredit;
+    cd->udpCredit -= count;
+    return count;
+}
+
+void udpForget(dataContainer* d, clientParameters* cd)
+{
+    unsigned b = (cd->clientAddr.sin_addr.s_addr ^ cd->clientAddr.sin_port * 2654435761U) % UDPBUCKETS;
+    clientParameters** p = &d->udpBuckets[b];
+    while(*p != cd)
+        p = &(*p)->udpNext;
+    *p = cd->udpNext;
+}
+
+/*
+low latency profile: reactors and generators pinned to CPUs given by -A, memory locked and
+client records made before clients come with -M, busy polling of client sockets with -b.
+-j shows how late generators wake up, it is the noise which makes flow of reports swing
+*/
+
+//records are taken from the pool and given back, so their pages are faulted in now
+void prefaultClients(dataContainer* d)
+{
+    int count = d->maxConnections < PREFAULTCLIENTS ? d->maxConnections : PREFAULTCLIENTS;
+    clientParameters* list = NULL;
+    for(int i = 0; i < count; i++)
+    {
+        clientParameters* cd = allocClient(d);
+        cd->next = list;
+        list = cd;
+    }
+    while(list != NULL)
+    {
+        clientParameters* cd = list;
+        list = cd->next;
+        freeClient(d, cd);
+    }
+    if(d->queueCap < count)
+    {
+        d->queueCap = count;
+        if((d->waitQueue = realloc(d->waitQueue, d->queueCap * sizeof(clientParameters*))) == NULL)
+            errExit("realloc");
+        memset(d->waitQueue, 0, d->queueCap * sizeof(clientParameters*));
+    }
+}
+
+void sleepMeasured(dataContainer* d, const struct timespec* ts)
+{
+    unsigned long before = d->jitter != NULL ? nowUs() : 0;
+    if(nanosleep(ts, NULL) == -1)
+        errExit("nanosleep");
+    if(d->jitter != NULL)
+        recordJitter(d, (long)(nowUs() - before) - (ts->tv_sec * 1000000L + ts->tv_nsec / 1000));
+}
+
+void recordJitter(dataContainer* d, long us)
+{
+    if(us < 0)
+        us = 0;
+    histAdd(&d->jitter->sleeps, us);
+    unsigned long max = atomic_load_explicit(&d->jitter->maxSleep, memory_order_relaxed);
+    while((unsigned long)us > max && !atomic_compare_exchange_weak_explicit(&d->jitter->maxSleep, &max, us,
+        memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+//histogram is emptied, so every report shows only its own 5 seconds
+void reportJitter(dataContainer* d)
+{
+    histogram h = {0};
+    for(int i = 0; i < HISTBUCKETS; i++)
+        atomic_store_explicit(&h.bucket[i], atomic_exchange_explicit(&d->jitter->sleeps.bucket[i], 0, 
+            memory_order_relaxed), memory_order_relaxed);
+    unsigned long now = nowUs();
+    logRecord* rec = logBegin(d, LOG_JITTER, NULL);
+    if(rec != NULL)
+    {
+        rec->level = histPercentile(&h, 0.5);
+        rec->capacity = histPercentile(&h, 0.99);
+        rec->clients = atomic_exchange_explicit(&d->jitter->maxSleep, 0, memory_order_relaxed);
+        rec->flow = d->lastReportUs != 0 ? (long)(now - d->lastReportUs) - REPORTPERIOD * 1000000L : 0;
+        logCommit(d);
+    }
+    d->lastReportUs = now;
+}
+
+/*
+local transport: client on the same host connects to Unix socket and sends requestHeader like over TCP.
+When admitted, its blocks are claimed in storage and it gets only their places, it copies them itself
+and sends REQ_DONE back, then the place goes back to generator
+*/
+void createLocalServer(dataContainer* d)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if(strlen(d->localPath) >= sizeof(addr.sun_path))
+    {
+        printf("local socket path is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, d->localPath);
+    unlink(d->localPath);     //left by previous run
+
+    if((d->localfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        errExit("socket");
+    if(bind(d->localfd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        errExit("bind");
+    if(listen(d->localfd, LISTENBACKLOG) == -1)
+        errExit("listen");
+}
+
+//local clients count into limit of connections, but they are never left in backlog
+void acceptLocalClient(dataContainer* d)
+{
+    while(1)
+    {
+        int fd = accept4(d->localfd, NULL, NULL, SOCK_NONBLOCK);
+        if(fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                pauseAccepting(d, PAUSE_RESOURCES);
+                return;
+            }
+            errExit("accept4");
+        }
+        struct sockaddr_in none = {0};
+        if(d->connections >= d->maxConnections)
+        {
+            rejectClient(d, fd, &none);
+            continue;
+        }
+
+        d->connections++;
+        clientParameters* cd = allocClient(d);
+        cd->fd = fd;
+        cd->clientAddr = none;
+        cd->local = 1;
+        if(d->stats != NULL)
+        {
+            countStat(&d->stats->accepted, 1);
+            cd->acceptedUs = nowUs();
+        }
+        cd->readingHeader = 1;
+        cd->progressUs = d->wheel.nowUs;
+        armClientDeadline(d, cd);
+        addClientToEpoll(d, EPOLLIN | EPOLLRDHUP, cd);
+    }
+}
+
+//blocks are taken out of storage for client, but their place stays claimed until it releases them
+void localGrantParts(dataContainer* d, clientParameters* cd)
+{
+    int blocks = cd->numOfRequestedBlocks;
+    int bytes = blocks * DATABLOCK;
+    localGrant g = { PROTOMAGIC, blocks, 0, d->numOfGenerators, d->ring->capacity, 
+        offsetof(sharedRing, data), {{0}} };
+    if(cd->localParts == NULL && (cd->localParts = malloc(MAXGENERATORS * sizeof(localPart))) == NULL)
+        errExit("malloc");
+    recordSendStart(d, cd, blocks);
+    for(int off = 0; off < bytes; )
+    {
+        unsigned long start;
+        int len;
+        sharedRing* r = shardClaim(d, bytes - off, &start, &len);
+        uint32_t shard = 0;
+        while(d->shards[shard] != r)
+            shard++;
+        //one reactor claims alone, so parts from the same shard follow each other
+        int i = 0;
+        while(i < cd->localCount && cd->localParts[i].shard != shard)
+            i++;
+        if(i == cd->localCount)
+        {
+            cd->localParts[i] = (localPart){ shard, 0, start };
+            cd->localCount++;
+        }
+        cd->localParts[i].len += len;
+        off += len;
+    }
+    d->localHolders++;
+    d->numOfBlocks -= blocks;
+    cd->numOfRequestedBlocks = 0;
+    g.parts = cd->localCount;
+    memcpy(g.part, cd->localParts, cd->localCount * sizeof(localPart));
+
+    struct iovec iov = { &g, sizeof(g) };
+    struct msghdr msg = {0};
+    char control[CMSG_SPACE(sizeof(int) * MAXGENERATORS)];
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(!cd->ringSent)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * d->numOfGenerators);
+        struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * d->numOfGenerators);
+        memcpy(CMSG_DATA(c), d->ringFds, sizeof(int) * d->numOfGenerators);
+    }
+    //tiny message into empty socket, when even that doesn't fit client is gone
+    if(sendmsg(cd->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(g))
+    {
+        clientLost(d, cd);
+        return;
+    }
+    cd->ringSent = 1;
+    cd->headerLen = 0;  //release comes into the same buffer as request
+    addClientToEpoll(d, EPOLLIN | EPOLLRDHUP, cd);
+    armClientDeadline(d, cd);   //hold deadline, even without -D and -T
+}
+
+void readLocalRelease(dataContainer* d, clientParameters* cd)
+{
+    ssize_t r = recv(cd->fd, cd->header + cd->headerLen, sizeof(requestHeader) - cd->headerLen, 0);
+    if(r == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if(r > 0)
+    {
+        cd->headerLen += r;
+        cd->progressUs = d->wheel.nowUs;
+        if(cd->headerLen < (int)sizeof(requestHeader))
+            return;
+    }
+    requestHeader h;
+    memcpy(&h, cd->header, sizeof(h));
+    cd->headerLen = 0;
+    if(r <= 0 || ntohl(h.magic) != PROTOMAGIC || !(ntohl(h.flags) & REQ_DONE))
+    {
+        if( epoll_ctl(d->epollfd, EPOLL_CTL_DEL, cd->fd, NULL))
+            errExit("epoll_ctl");
+        clientLost(d, cd);
+        return;
+    }
+    releaseLocal(d, cd);
+    recordBlockSent(d, cd);     //from grant to release
+    finishPortion(d, cd);
+}
+
+void releaseLocal(dataContainer* d, clientParameters* cd)
+{
+    for(int i = 0; i < cd->localCount; i++)
+        ringRelease(d, d->shards[cd->localParts[i].shard], cd->localParts[i].start, cd->localParts[i].len);
+    cd->localCount = 0;
+    d->localHolders--;
+}
+
+/*
+only with one reactor: parts released out of order wait in d->released, the one at tail
+moves it and takes all runs which follow. Sends are released in order, so runs merge
+and there are only about as many of them as holders
+*/
+void deferRelease(dataContainer* d, sharedRing* r, unsigned long start, int bytes)
+{
+    unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if(start != tail)
+    {
+        releasedRun* last = d->releasedLen > 0 ? &d->released[d->releasedLen - 1] : NULL;
+        if(last != NULL && last->ring == r && last->end == start)
+        {
+            last->end += bytes;
+            return;
+        }
+        if(d->releasedLen == d->releasedCap)
+        {
+            d->releasedCap = d->releasedCap ? 2 * d->releasedCap : MAXGENERATORS;
+            if((d->released = realloc(d->released, d->releasedCap * sizeof(releasedRun))) == NULL)
+                errExit("realloc");
+        }
+        d->released[d->releasedLen++] = (releasedRun){ r, start, start + bytes };
+        return;
+    }
+    tail += bytes;
+    for(int i = 0; i < d->releasedLen; )
+    {
+        if(d->released[i].ring == r && d->released[i].start == tail)
+        {
+            tail = d->released[i].end;
+            d->released[i] = d->released[--d->releasedLen];
+            i = 0;
+        }
+        else
+            i++;
+    }
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+}
+
+/*
+broadcast: subscriber gets blocks published from now on, as many as it asked for;
+it is in epoll all the time, with EPOLLOUT only when there is something to send
+*/
+void subscribe(dataContainer* d, clientParameters* cd)
+{
+    if(d->negotiate)
+    {
+        grantHeader g = { htonl(PROTOMAGIC), htonl(cd->numOfRequestedBlocks | GRANT_BROADCAST) };
+        stashPending(cd, (char*)&g, sizeof(g));
+    }
+    if(d->numOfSubscribers == d->subscribersCap)
+    {
+        d->subscribersCap = d->subscribersCap ? 2 * d->subscribersCap : EVENTBATCH;
+        if((d->subscribers = realloc(d->subscribers, d->subscribersCap * sizeof(clientParameters*))) == NULL)
+            errExit("realloc");
+    }
+    cd->subIndex = d->numOfSubscribers;
+    d->subscribers[d->numOfSubscribers++] = cd;
+    cd->bcastNext = d->published;
+    cd->bcastOff = 0;
+    cd->bcastWanted = cd->numOfRequestedBlocks;
+    d->wanting++;
+    cd->admittedUs = cd->progressUs = d->wheel.nowUs;
+    armClientDeadline(d, cd);
+    cd->bcastWriting = cd->pendingLen > 0;
+    addClientToEpoll(d, EPOLLRDHUP | (cd->bcastWriting ? EPOLLOUT : 0), cd);
+    publishBlocks(d);
+}
+
+//blocks published for client but not sent are given back, nobody else needs them from us
+void unsubscribe(dataContainer* d, clientParameters* cd)
+{
+    unsigned long end = cd->bcastNext + cd->numOfRequestedBlocks - cd->bcastWanted;
+    for(unsigned long n = cd->bcastNext; n < end; n++)
+        releaseBlock(d, n);
+    if(cd->bcastWanted > 0)
+        d->wanting--;
+    cd->numOfRequestedBlocks = cd->bcastWanted = 0;
+    clientParameters* last = d->subscribers[--d->numOfSubscribers];
+    d->subscribers[cd->subIndex] = last;
+    last->subIndex = cd->subIndex;
+    cd->subIndex = -1;
+}
+
+/*
+one block of storage goes to all subscribers which still want some. When the oldest block
+in window is still not sent by someone, stream waits for it while storage has room;
+when storage is full, subscribers which hold it are evicted
+*/
+void publishBlocks(dataContainer* d)
+{
+    unsigned long produced = 0;
+    if(d->eventDriven)
+        produced = atomic_load(&d->gen->produced);
+    int str = storageLevel(d);
+    int blocked = 0;
+    while(d->wanting > 0 && str >= DATABLOCK)
+    {
+        unsigned long n = d->published;
+        if(d->window[n % d->broadcastLag] != NULL)
+        {
+            if(str < storageUsable(d))
+            {
+                blocked = 1;
+                break;
+            }
+            for(int i = 0; i < d->numOfSubscribers; )
+            {
+                clientParameters* cd = d->subscribers[i];
+                if(n - cd->bcastNext >= (unsigned long)d->broadcastLag && cd->numOfRequestedBlocks > cd->bcastWanted)
+                    evictClient(d, cd, LOG_LAGGING);    //last one takes its place in array
+                else
+                    i++;
+            }
+            if(d->wanting == 0)
+                break;
+        }
+
+        sharedBlock* b = d->freeBlocks;
+        if(b != NULL)
+            d->freeBlocks = b->next;
+        else if((b = malloc(sizeof(sharedBlock))) == NULL)
+            errExit("malloc");
+        storageCopy(d, b->data, DATABLOCK);
+        str -= DATABLOCK;
+        if(d->integrity)
+            sealBlock(b->data, (uint32_t)n);    //number in stream, the same for everyone
+        b->refs = 0;
+        for(int i = 0; i < d->numOfSubscribers; i++)
+        {
+            clientParameters* cd = d->subscribers[i];
+            if(cd->bcastWanted == 0)
+                continue;
+            b->refs++;
+            if(--cd->bcastWanted == 0)
+                d->wanting--;
+            if(!cd->bcastWriting)
+                watchSubscriber(d, cd, 1);
+        }
+        d->window[n % d->broadcastLag] = b;
+        d->published++;
+    }
+    if(d->eventDriven && d->wanting > 0)
+        armGeneratorWakeup(d, produced + (blocked ? storageUsable(d) : DATABLOCK) + 1 - str);
+}
+
+//from shared copy; partly sent block stays in window, only offset is remembered
+void sendBroadcast(dataContainer* d, clientParameters* cd)
+{
+    if(cd->pendingLen > 0 && !sendPending(cd))
+        return;
+    while(cd->numOfRequestedBlocks > cd->bcastWanted)
+    {
+        sharedBlock* b = d->window[cd->bcastNext % d->broadcastLag];
+        if(cd->bcastOff == 0)
+            recordSendStart(d, cd, 1);
+        ssize_t w = send(cd->fd, b->data + cd->bcastOff, DATABLOCK - cd->bcastOff, MSG_NOSIGNAL);
+        if(w == -1)
+        {
+            if(errno != EINTR && errno != EAGAIN)
+                errExit("send");
+            return;
+        }
+        cd->bcastOff += w;
+        if(cd->bcastOff < DATABLOCK)
+            return;
+        recordBlockSent(d, cd);
+        cd->bcastOff = 0;
+        releaseBlock(d, cd->bcastNext++);
+        cd->numOfRequestedBlocks--;
+    }
+    if(cd->numOfRequestedBlocks == 0)
+        finishPortion(d, cd);
+    else
+        watchSubscriber(d, cd, 0);  //everything published is sent, wait for next block
+    publishBlocks(d);   //stream could wait for this subscriber
+}
+
+void releaseBlock(dataContainer* d, unsigned long n)
+{
+    sharedBlock* b = d->window[n % d->broadcastLag];
+    if(--b->refs > 0)
+        return;
+    b->next = d->freeBlocks;
+    d->freeBlocks = b;
+    d->window[n % d->broadcastLag] = NULL;
+}
+
+void watchSubscriber(dataContainer* d, clientParameters* cd, int writing)
+{
+    struct epoll_event ev = {0};
+    ev.events = EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = cd;
+    if(epoll_ctl(d->epollfd, EPOLL_CTL_MOD, cd->fd, &ev) == -1)
+        errExit("epoll_ctl");
+    cd->bcastWriting = writing;
+}
+
+/*
+every connection costs a descriptor, so the limit can't be above RLIMIT_NOFILE,
+a few are left for storage, timers, log and metrics. Reactors share it equally
+*/
+void limitConnections(dataContainer* d)
+{
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        errExit("getrlimit");
+    if(rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            errExit("setrlimit");
+    }
+    long max = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX ? INT_MAX : (long)rl.rlim_cur - FDRESERVE;
+    if(max < 1)
+        max = 1;
+    if(d->maxConnections == 0)
+        d->maxConnections = max;
+    else if(d->maxConnections > max)
+    {
+        printf("only %ld descriptors for clients, limit of connections lowered\n", max);
+        d->maxConnections = max;
+    }
+    if(d->numOfReactors > 1)
+        d->maxConnections = d->maxConnections / d->numOfReactors > 0 ? d->maxConnections / d->numOfReactors : 1;
+}
+
+/*
+over the limit next clients stay in kernel backlog until someone goes away; when accept fails
+for lack of descriptors or memory, which can come from whole process or system, nobody of ours
+has to go away, so it is tried again after ACCEPTRETRY
+*/
+void pauseAccepting(dataContainer* d, int reason)
+{
+    if(reason == PAUSE_RESOURCES)
+    {
+        d->acceptRetryUs = nowUs() + ACCEPTRETRY * 1000UL;
+        //local clients need descriptors too, level-triggered listener would wake epoll_wait at once
+        if(d->localPath != NULL && !d->localPaused)
+        {
+            d->localPaused = 1;
+            if(epoll_ctl(d->epollfd, EPOLL_CTL_DEL, d->localfd, NULL) == -1)
+                errExit("epoll_ctl");
+        }
+        //event driven io_uring has no tick which would try it
+        if(d->uring != NULL && d->eventDriven && d->acceptPaused != PAUSE_RESOURCES)
+            uringArmTimeout(d, URING_TICK, &d->uring->retry);
+    }
+    if(d->acceptPaused)
+    {
+        if(reason == PAUSE_RESOURCES)
+            d->acceptPaused = reason;   //retried by time, not only when client goes away
+        return;
+    }
+    d->acceptPaused = reason;
+    logRecord* rec = logBegin(d, LOG_PAUSED, NULL);
+    if(rec != NULL)
+    {
+        rec->clients = d->connections;
+        logCommit(d);
+    }
+    if(d->uring != NULL)
+    {
+        if(d->uring->acceptArmed)   //multishot accept ends with -ECANCELED
+            uringSqe(d, IORING_OP_ASYNC_CANCEL, 0)->addr = URING_ACCEPT;
+    }
+    else if(epoll_ctl(d->epollfd, EPOLL_CTL_DEL, d->server_fd, NULL) == -1)
+        errExit("epoll_ctl");
+}
+
+void resumeAccepting(dataContainer* d)
+{
+    d->acceptPaused = PAUSE_NONE;
+    if(d->localPaused)
+    {
+        d->localPaused = 0;
+        addClientToEpoll(d, EPOLLIN, d->localRecord);
+    }
+    if(d->uring != NULL)
+    {
+        if(!d->uring->acceptArmed)
+            uringArmAccept(d);
+    }
+    else
+        addClientToEpoll(d, EPOLLIN, d->listenRecord);
+}
+
+//still over the limit, accept stops again at once
+void retryAccepting(dataContainer* d)
+{
+    if(d->acceptPaused == PAUSE_RESOURCES && nowUs() >= d->acceptRetryUs)
+        resumeAccepting(d);
+}
+
+//over the limit in reject mode; with -H client learns it from grant of 0 blocks, fd -1 - datagram client
+void rejectClient(dataContainer* d, int fd, struct sockaddr_in* addr)
+{
+    if(fd == -1)
+        udpControl(d, addr, UDPREJECTED, 0);
+    else
+    {
+        if(d->negotiate)
+        {
+            grantHeader g = { htonl(PROTOMAGIC), 0 };
+            send(fd, &g, sizeof(g), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        close(fd);
+    }
+    if(d->stats != NULL)
+        countStat(&d->stats->rejected, 1);
+    clientParameters cd;
+    cd.clientAddr = *addr;
+    logRecord* rec = logBegin(d, LOG_REJECTED, &cd);
+    if(rec != NULL)
+    {
+        rec->clients = d->connections;
+        logCommit(d);
+    }
+}
+
+//takes all waiting connections at once, listening socket is nonblocking
+void acceptNewClient(dataContainer* d)
+{
+    while(1)
+    {
+        if(d->connections >= d->maxConnections && !d->rejectOverLimit)
+        {
+            pauseAccepting(d, PAUSE_LIMIT);  //next ones wait in kernel backlog
+            return;
+        }
+        struct sockaddr_in client;
+        socklen_t c = sizeof(struct sockaddr_in);
+        int client_sock = accept4(d->server_fd, (struct sockaddr *)&client, &c, SOCK_NONBLOCK);
+        if(client_sock == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                pauseAccepting(d, PAUSE_RESOURCES);
+                return;
+            }
+            errExit("accept4");
+        }
+        if(d->connections >= d->maxConnections)
+        {
+            rejectClient(d, client_sock, &client);
+            continue;
+        }
+
+        d->connections++;
+        clientParameters* cd = allocClient(d);
+        cd->fd = client_sock;
+        cd->clientAddr = client;
+        if(d->busyPoll > 0)
+            setBusyPoll(&d->busyPoll, client_sock);
+        if(d->stats != NULL)
+        {
+            countStat(&d->stats->accepted, 1);
+            cd->acceptedUs = nowUs();
+        }
+        if(d->negotiate)
+        {
+            cd->readingHeader = 1;
+            cd->progressUs = d->wheel.nowUs;
+            armClientDeadline(d, cd);
+            addClientToEpoll(d, EPOLLIN | EPOLLRDHUP, cd);
+            continue;
+        }
+        cd->numOfRequestedBlocks = 4;
+        placeClientInRingBuffOrEpoll(d, cd);
+    }
+}
+
+void generateReport(dataContainer* d, int NumOfClients)
+{
+    uint64_t numExp;
+    if ((numExp = read(d->timerfd, &numExp, sizeof(uint64_t)) != sizeof(uint64_t)) )            
+        errExit("read");
+    reportStorage(d, NumOfClients);
+    if(d->jitter != NULL)
+        reportJitter(d);
+}
+
+void reportStorage(dataContainer* d, int NumOfClients)
+{
+    int pipeCapacity = storageCapacity(d);
+    int str = storageLevel(d);
+    logRecord* rec = logBegin(d, LOG_REPORT, NULL);
+    if(rec != NULL)
+    {
+        rec->level = str;
+        rec->capacity = pipeCapacity;
+        rec->clients = NumOfClients;
+        rec->flow = str - d->generatedBytes;
+        logCommit(d);
+    }
+    d->generatedBytes = str;
+}
+
+void checkClient(dataContainer* d, struct epoll_event* events, int iter , clientParameters* cd)
+{
+    if( cd->readingHeader )
+    {
+        if( events[iter].events & EPOLLIN )
+            readClientHeader(d, cd);
+        else
+            dropClient(d, cd, LOG_NOREQUEST);
+    }
+    else if( cd->local )
+    {
+        if( events[iter].events & EPOLLIN )
+            readLocalRelease(d, cd);
+        else
+        {
+            if( epoll_ctl(d->epollfd, EPOLL_CTL_DEL, cd->fd, NULL))
+                errExit("epoll_ctl");
+            clientLost(d, cd);
+        }
+    }
+    else if( events[iter].events & EPOLLRDHUP )   
+    {
+        if( epoll_ctl(d->epollfd, EPOLL_CTL_DEL, cd->fd, NULL))
+            errExit("epoll_ctl 1");
+        clientLost(d, cd);
+    }
+
+    else if( events[iter].events & EPOLLOUT )
+        operateOnClient( events, iter, d);
+                  
+}
+
+int operateOnClient( struct epoll_event* events, int iter, dataContainer* d )
+{
+    clientParameters* cd = events[iter].data.ptr;
+    cd->progressUs = d->wheel.nowUs;    //socket has room again, so client reads
+
+    if(cd->subIndex >= 0)
+    {
+        sendBroadcast(d, cd);
+        return 0;
+    }
+    if(d->edgeTriggered)
+    {
+        operateOnClientEdge(d, cd);
+        return 0;
+    }
+    
+    if(cd->pendingLen > 0)
+    {
+        if(sendPending(cd))
+            recordBlockSent(d, cd);
+    }
+    else
+    {
+        recordSendStart(d, cd, 1);
+        if(storageSend(d, cd, DATABLOCK))
+            recordBlockSent(d, cd);
+        cd->numOfRequestedBlocks--;
+        d->numOfBlocks--;
+    }
+
+    if(cd->numOfRequestedBlocks == 0 && cd->pendingLen == 0)
+        finishPortion(d, cd);
+    else
+    {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLOUT | EPOLLRDHUP;
+        ev.data.ptr = cd;
+        if ( epoll_ctl( d->epollfd, EPOLL_CTL_MOD, cd->fd, &ev ) == -1 ) 
+            errExit("epoll_ctl ");  
+    }
+    
+    return 0;
+}
+
+/*
+in edge triggered mode we get EPOLLOUT only when socket becomes writable again,
+so client gets as many blocks as socket accepts, SENDBATCH of them in one syscall
+*/
+void operateOnClientEdge(dataContainer* d, clientParameters* cd)
+{
+    while(1)
+    {
+        if(cd->pendingLen > 0)
+        {
+            if(!sendPending(cd))
+                return;     //socket is full, wait for next edge
+            recordBlockSent(d, cd);
+        }
+        if(cd->numOfRequestedBlocks == 0)
+        {
+            finishPortion(d, cd);
+            return;
+        }
+
+        int blocks = cd->numOfRequestedBlocks < SENDBATCH ? cd->numOfRequestedBlocks : SENDBATCH;
+        recordSendStart(d, cd, blocks);
+        int done = storageSend(d, cd, blocks * DATABLOCK);
+        cd->numOfRequestedBlocks -= blocks;
+        d->numOfBlocks -= blocks;
+        if(!done)
+            return;
+        recordBlockSent(d, cd);
+    }
+}
+
+void readClientHeader(dataContainer* d, clientParameters* cd)
+{
+    ssize_t r = recv(cd->fd, cd->header + cd->headerLen, sizeof(requestHeader) - cd->headerLen, 0);
+    if(r == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if(r <= 0)
+    {
+        dropClient(d, cd, LOG_NOREQUEST);
+        return;
+    }
+    cd->headerLen += r;
+    cd->progressUs = d->wheel.nowUs;
+    if(cd->headerLen < (int)sizeof(requestHeader))
+        return;
+
+    requestHeader h;
+    memcpy(&h, cd->header, sizeof(h));
+    int blocks = ntohl(h.blocks);
+    if(ntohl(h.magic) != PROTOMAGIC || blocks <= 0)
+    {
+        dropClient(d, cd, LOG_BADREQUEST);
+        return;
+    }
+    //more than storage can ever hold would wait forever, broadcast reserves nothing
+    int maxBlocks = d->broadcastLag > 0 ? INT_MAX : (storageUsable(d) - 1) / DATABLOCK;
+    cd->numOfRequestedBlocks = blocks < maxBlocks ? blocks : maxBlocks;
+    cd->readingHeader = 0;
+    if(d->stats != NULL && cd->keepAlive)
+        cd->acceptedUs = nowUs();   //next request on kept connection, first byte is measured from it
+    cd->keepAlive = ntohl(h.flags) & REQ_KEEPALIVE;
+    cd->deadlineMs = ntohl(h.deadlineMs);
+
+    //it comes back to epoll when storage has data for it
+    if( epoll_ctl(d->epollfd, EPOLL_CTL_DEL, cd->fd, NULL) == -1)
+        errExit("epoll_ctl");
+    placeClientInRingBuffOrEpoll(d, cd);
+}
+
+/*
+keep-alive client waits for its next request in epoll, the same as just after accept,
+so next portion costs no handshake and no socket in TIME_WAIT
+*/
+void finishPortion(dataContainer* d, clientParameters* cd)
+{
+    if(cd->subIndex >= 0)
+        unsubscribe(d, cd);
+    if(!cd->keepAlive)
+    {
+        disconnectFromServer(cd, d);
+        return;
+    }
+    d->numOfClients--;
+    if(d->stats != NULL)
+    {
+        countStat(&d->stats->served, 1);
+        cd->firstByteSent = 0;
+    }
+    logRecord* rec = logBegin(d, LOG_SERVED, cd);
+    if(rec != NULL)
+    {
+        rec->lost = cd->numOfRequestedBlocks;
+        logCommit(d);
+    }
+    cd->readingHeader = 1;
+    cd->headerLen = 0;
+    cd->progressUs = d->wheel.nowUs;
+    armClientDeadline(d, cd);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = cd;
+    if( epoll_ctl(d->epollfd, EPOLL_CTL_MOD, cd->fd, &ev) == -1)
+        errExit("epoll_ctl");
+}
+
+//for clients which have nothing reserved yet
+void dropClient(dataContainer* d, clientParameters* cd, int type)
+{
+    if(logBegin(d, type, cd) != NULL)
+        logCommit(d);
+    closeClient(d, cd);
+}
+
+void addClientToEpoll(dataContainer* d, int flags, clientParameters* cd)
+{
+    d->ev.events = flags;
+    d->ev.data.ptr = cd;
+    if (epoll_ctl(d->epollfd, EPOLL_CTL_ADD, cd->fd, &(d->ev) ) == -1) 
+        errExit("epoll_ctl ");
+
+}
+
+//for server's own descriptors, they are recognized in loop by fd
+clientParameters* addFdToEpoll(dataContainer* d, int flags, int fd)
+{
+    clientParameters* cd = allocClient(d);
+    cd->fd = fd;
+    addClientToEpoll(d, flags, cd);
+    return cd;
+}
+
+void placeClientInRingBuffOrEpoll(dataContainer* d, clientParameters* cd)
+{
+    d->numOfClients++;
+    if(d->broadcastLag > 0)
+    {
+        subscribe(d, cd);
+        return;
+    }
+    if(d->stats != NULL)
+    {
+        atomic_fetch_add_explicit(&d->stats->waiting, 1, memory_order_relaxed);
+        cd->queuedUs = nowUs();
+    }
+    //new client takes its place in queue, then as many as storage allows are admitted
+    setPriority(d, cd);
+    addElem(d, cd);
+    armClientDeadline(d, cd);
+    admitWaitingClients(d);
+}
+
+void createSetEpoll(dataContainer* d)
+{
+    if((d->epollfd = epoll_create1(0)) == -1)
+        errExit("epoll_create1");
+    
+    createClientStructures(d);
+    d->listenRecord = addFdToEpoll(d, EPOLLIN, d->server_fd);
+    if(d->reactorId == 0)
+        addFdToEpoll(d, EPOLLIN, d->timerfd);    
+    if(d->reactorId == 0 && d->stats != NULL)
+        addFdToEpoll(d, EPOLLIN, d->metricsfd);
+    if(d->eventDriven)
+        addFdToEpoll(d, EPOLLIN, d->eventfd);
+    if(d->datagrams)
+        addFdToEpoll(d, EPOLLIN, d->udpfd);
+    if(d->localPath != NULL)
+        d->localRecord = addFdToEpoll(d, EPOLLIN, d->localfd);
+}
+
+//the same for both backends
+void createClientStructures(dataContainer* d)
+{
+    wheelInit(&d->wheel);   //shards got copy of pointers to wheel of reactor 0
+    freeClient(d, allocClient(d));     //first slab of pool is ready before clients come
+    if(d->broadcastLag > 0 && (d->window = calloc(d->broadcastLag, sizeof(sharedBlock*))) == NULL)
+        errExit("calloc");
+    if(d->datagrams && (d->udpBuckets = calloc(UDPBUCKETS, sizeof(clientParameters*))) == NULL)
+        errExit("calloc");
+    d->queueCap = EVENTBATCH;   //grows with queue, see addElem
+    if((d->waitQueue = calloc(d->queueCap, sizeof(clientParameters*))) == NULL)
+        errExit("calloc");
+    if(d->logger != NULL)   //simulation logs nothing
+        d->log = &d->logger->rings[d->reactorId];
+    if(d->lockMemory)
+    {
+        prefaultClients(d);
+        lockMemory();   //setup of reactor is done
+    }
+}
+
+void armTimer(dataContainer* d)
+{
+    struct itimerspec value;
+
+    value.it_value.tv_sec = REPORTPERIOD;
+    value.it_value.tv_nsec = 0;
+
+    value.it_interval.tv_sec = REPORTPERIOD;
+    value.it_interval.tv_nsec = 0;
+
+    d->timerfd = timerfd_create(CLOCK_REALTIME, 0);    
+    if (d->timerfd == -1)        
+        errExit("timerfd_create");    
+
+    if (timerfd_settime(d->timerfd, 0, &value, NULL) == -1)       
+        errExit("timerfd_settime");
+}
+
+//client went away before it got everything, its reserved blocks are thrown out of storage
+void clientLost(dataContainer* d, clientParameters* cd)
+{
+    if(cd->subIndex >= 0)
+        unsubscribe(d, cd);
+    d->numOfClients--;
+    d->numOfBlocks -= cd->numOfRequestedBlocks;
+    storageDiscard(d, cd->numOfRequestedBlocks * DATABLOCK);
+    int lost = cd->numOfRequestedBlocks * DATABLOCK + cd->pendingLen - cd->pendingOff;
+    if(d->stats != NULL)
+    {
+        countStat(&d->stats->disconnected, 1);
+        countStat(&d->stats->bytesLost, lost);
+    }
+    logRecord* rec = logBegin(d, LOG_DISCONNECTED, cd);
+    if(rec != NULL)
+    {
+        rec->lost = lost;
+        logCommit(d);
+    }
+    closeClient(d, cd);
+}
+
+void disconnectFromServer(clientParameters* cd, dataContainer* d)
+{
+    d->numOfClients--;
+    if(d->stats != NULL)
+        countStat(&d->stats->served, 1);
+    if(!cd->datagram)
+        shutdown( cd->fd, SHUT_RDWR );
+    logRecord* rec = logBegin(d, LOG_SERVED, cd);
+    if(rec != NULL)
+    {
+        rec->lost = cd->numOfRequestedBlocks;
+        logCommit(d);
+    }
+    closeClient(d, cd);
+}
+
+//client records come from slabs and go back to free list, they are never given back to system
+clientParameters* allocClient(dataContainer* d)
+{
+    if(d->freeClients == NULL)
+    {
+        clientParameters* slab = calloc(CLIENTSLAB, sizeof(clientParameters));
+        if(slab == NULL)
+            errExit("calloc");
+        for(int i = 0; i < CLIENTSLAB; i++)
+            freeClient(d, &slab[i]);
+        if(d->stats != NULL)
+            countStat(&d->stats->records, CLIENTSLAB);
+    }
+    clientParameters* cd = d->freeClients;
+    d->freeClients = cd->next;
+    if(cd->pending != NULL)
+        d->retainedBuffers--;
+
+    char* pending = cd->pending;    //buffer stays with record for next client
+    int pendingCap = cd->pendingCap;
+    memset(cd, 0, sizeof(clientParameters));
+    cd->pending = pending;
+    cd->pendingCap = pendingCap;
+    cd->queueIndex = -1;
+    cd->subIndex = -1;
+    return cd;
+}
+
+void freeClient(dataContainer* d, clientParameters* cd)
+{
+    wheelCancel(&d->wheel, &cd->timer);
+    if(cd->pending != NULL && d->retainedBuffers >= RETAINEDBUFFERS)
+    {
+        //after burst of slow clients pool would keep all their buffers
+        free(cd->pending);
+        cd->pending = NULL;
+        cd->pendingCap = 0;
+    }
+    else if(cd->pending != NULL)
+        d->retainedBuffers++;
+    cd->next = d->freeClients;
+    d->freeClients = cd;
+}
+
+//connected client goes away, its place may let listening socket back
+void closeClient(dataContainer* d, clientParameters* cd)
+{
+    if(cd->datagram)
+        udpForget(d, cd);   //socket belongs to reactor, there was no connection
+    else
+    {
+        if(cd->localCount > 0)
+            releaseLocal(d, cd);    //what client didn't copy is lost
+        free(cd->localParts);
+        close(cd->fd);
+    }
+    releaseRecord(d, cd);
+    d->connections--;
+    if(d->acceptPaused == PAUSE_LIMIT && d->connections < d->maxConnections)
+        resumeAccepting(d);
+}
+
+/*
+client can be closed from handler of other client's event (broadcast evicts laggers),
+later events of the same batch still point to its record, so it waits for end of batch
+*/
+void releaseRecord(dataContainer* d, clientParameters* cd)
+{
+    if(!d->inBatch)
+    {
+        freeClient(d, cd);
+        return;
+    }
+    wheelCancel(&d->wheel, &cd->timer);
+    cd->dead = 1;
+    cd->next = d->deadClients;
+    d->deadClients = cd;
+}
+
+void freeDeadClients(dataContainer* d)
+{
+    while(d->deadClients != NULL)
+    {
+        clientParameters* cd = d->deadClients;
+        d->deadClients = cd->next;
+        freeClient(d, cd);
+    }
+}
+
+void child(int toWrite, dataContainer* d)
+{
+    if(d->batchedGenerator)
+    {
+        childBatched(toWrite, d);
+        return;
+    }
+    if(d->useRing)
+    {
+        childRing(d);
+        return;
+    }
+    int pipeCapacity = fcntl(toWrite, F_GETPIPE_SZ);
+    int storagedInPipe = 0;
+    int onProgress = 1; 
+    struct timespec ts ={0};
+    float times = BLOCK / (RATE * d->frequency);
+    ts.tv_sec = (long)times;
+    ts.tv_nsec = (long)((times - ts.tv_sec )*1e9);
+    char c = 'a';
+    
+    while(onProgress)
+    {
+        if( ioctl(toWrite, FIONREAD, &storagedInPipe) == -1)
+            errExit("ioctl");
+        while(pipeCapacity - storagedInPipe >= BLOCK)
+        {
+            if( insertBlock(toWrite, c) == -1)
+            {
+                onProgress = 0;
+                break;
+            }
+            notifyServer(d, BLOCK);
+            c+= 1;
+            if(c > 'z')
+                c = 'A';
+            if(c > 'Z')
+                c = 'a';
+                
+            sleepMeasured(d, &ts);
+            
+        
+            if( ioctl(toWrite, FIONREAD, &storagedInPipe) == -1)
+                errExit("ioctl"); 
+        }
+        //pipe is full, in event driven mode we don't want to spin here either
+        if(d->eventDriven && onProgress && nanosleep(&ts, NULL) == -1)
+            errExit("nanosleep");
+    } 
+   
+}
+
+void childRing(dataContainer* d)
+{
+    sharedRing* r = d->ring;
+    struct timespec ts ={0};
+    float times = BLOCK / (RATE * d->frequency);
+    ts.tv_sec = (long)times;
+    ts.tv_nsec = (long)((times - ts.tv_sec )*1e9);
+    char c = 'a';
+
+    while(1)
+    {
+        unsigned long storaged = atomic_load_explicit(&r->head, memory_order_relaxed) 
+            - atomic_load_explicit(&r->tail, memory_order_acquire);
+        if(r->capacity - storaged >= BLOCK)
+        {
+            insertBlockToRing(r, c);
+            notifyServer(d, BLOCK);
+            c+= 1;
+            if(c > 'z')
+                c = 'A';
+            if(c > 'Z')
+                c = 'a';
+        }
+        //unlike the pipe version we sleep also when storage is full, nobody wakes us anyway
+        sleepMeasured(d, &ts);
+    }
+}
+
+void notifyServer(dataContainer* d, int bytes)
+{
+    if(d->stats != NULL)
+        countStat(&d->stats->bytesGenerated, bytes);
+    if(d->gen == NULL)
+        return;
+    unsigned long produced = atomic_fetch_add(&d->gen->produced, bytes) + bytes;
+    for(int i = 0; i < d->numOfReactors || i == 0; i++)
+    {
+        unsigned long wakeAt = atomic_load(&d->gen->wakeAt[i]);
+        if(wakeAt != 0 && produced >= wakeAt && atomic_compare_exchange_strong(&d->gen->wakeAt[i], &wakeAt, 0))
+            if(eventfd_write(d->gen->eventfd[i], 1) == -1)
+                errExit("eventfd_write");
+    }
+}
+
+/*
+token bucket paced with absolute deadlines, so sleeping too long or too short is caught up
+in the next batch and long-run rate is exact. Data is copied from template of all letters,
+generator keeps position in it, so blocks look the same as from insertBlock
+*/
+void childBatched(int toWrite, dataContainer* d)
+{
+    double rate = RATE * d->frequency;  //bytes per second
+    int cycle = LETTERS * BLOCK;
+    char* templ = createTemplate();
+    long emitted = 0;   //bytes since start
+    int pos = 0;        //position in template
+    struct timespec start, now, next;
+    if(clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+        errExit("clock_gettime");
+
+    while(1)
+    {
+        if(clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+            errExit("clock_gettime");
+        double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        long allowed = (long)(rate * elapsed);
+        long bytes = allowed - emitted;
+        int freeSpace = storageFree(toWrite, d);
+        if(bytes > freeSpace)
+        {
+            //what was not produced while storage was full is lost, like in old generator
+            if(bytes - freeSpace > GENBURST * BLOCK)
+                emitted = allowed - freeSpace - GENBURST * BLOCK;
+            bytes = freeSpace;
+        }
+        bytes -= bytes % BLOCK;
+
+        while(bytes > 0)
+        {
+            size_t len = bytes < cycle ? bytes : cycle;
+            ssize_t w = putIntoStorage(toWrite, d, templ + pos, len);
+            if(w == -1)
+                return;     //server is gone
+            if(w == 0)
+                break;      //pipe is fuller than FIONREAD said
+            pos = (pos + w) % cycle;
+            bytes -= w;
+            emitted += w;
+            notifyServer(d, w);
+        }
+
+        //next block is due when bucket has one more block, but not more often than GENTICK
+        double due = (emitted + BLOCK) / rate;
+        next.tv_sec = start.tv_sec + (time_t)due;
+        next.tv_nsec = start.tv_nsec + (long)((due - (time_t)due) * 1e9);
+        long minNsec = now.tv_nsec + GENTICK;
+        if(next.tv_sec < now.tv_sec || (next.tv_sec == now.tv_sec && next.tv_nsec < minNsec))
+        {
+            next.tv_sec = now.tv_sec;
+            next.tv_nsec = minNsec;
+        }
+        if(next.tv_nsec >= 1000000000L)
+        {
+            next.tv_sec += next.tv_nsec / 1000000000L;
+            next.tv_nsec %= 1000000000L;
+        }
+        int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        if(err != 0 && err != EINTR)
+        {
+            errno = err;
+            errExit("clock_nanosleep");
+        }
+        if(d->jitter != NULL)
+        {
+            if(clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+                errExit("clock_gettime");
+            recordJitter(d, (now.tv_sec - next.tv_sec) * 1000000L + (now.tv_nsec - next.tv_nsec) / 1000);
+        }
+    }
+}
+
+//two cycles of letters, so every batch up to LETTERS blocks is continuous in memory
+char* createTemplate(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    char* templ = aligned_alloc(page, (2 * LETTERS * BLOCK + page - 1) / page * page);
+    if(templ == NULL)
+        errExit("aligned_alloc");
+    char c = 'a';
+    for(int i = 0; i < 2 * LETTERS; i++)
+    {
+        memset(templ + i * BLOCK, c, BLOCK - 1);
+        templ[(i + 1) * BLOCK - 1] = '\0';
+        c = (c == 'z') ? 'A' : (c == 'Z') ? 'a' : c + 1;
+    }
+    return templ;
+}
+
+int storageFree(int toWrite, dataContainer* d)
+{
+    if(d->useRing)
+        return (int)(d->ring->capacity - (atomic_load_explicit(&d->ring->head, memory_order_relaxed) 
+            - atomic_load_explicit(&d->ring->tail, memory_order_acquire)));
+    int str;
+    if( ioctl(toWrite, FIONREAD, &str) == -1)
+        errExit("ioctl");
+    return fcntl(toWrite, F_GETPIPE_SZ) - str;
+}
+
+//returns bytes put into storage, -1 when server closed the pipe
+ssize_t putIntoStorage(int toWrite, dataContainer* d, const char* src, size_t len)
+{
+    if(d->useRing)
+    {
+        sharedRing* r = d->ring;
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned long pos = head % r->capacity;
+        size_t first = r->capacity - pos < len ? r->capacity - pos : len;
+        memcpy(r->data + pos, src, first);
+        memcpy(r->data, src + first, len - first);
+        atomic_store_explicit(&r->head, head + len, memory_order_release);
+        return len;
+    }
+
+    ssize_t w;
+    if(d->useVmsplice && len >= VMSPLICEMIN)
+    {
+        //template is never changed, so pipe can keep references to its pages
+        struct iovec iov = { (void*)src, len };
+        w = vmsplice(toWrite, &iov, 1, SPLICE_F_NONBLOCK);
+    }
+    else
+        w = write(toWrite, src, len);
+
+    if(w == -1)
+    {
+        if(errno == EPIPE)
+            return -1;
+        if(errno == EAGAIN || errno == EINTR)
+            return 0;
+        errExit("write");
+    }
+    return w;
+}
+
+int insertBlock(int fdToWrite, char c)
+{
+    char producedData[BLOCK]={0}; 
+    int errorOccured = 0;
+
+    for(int i=0; i< BLOCK - 1; i++)
+        producedData[i] = c;
+    producedData[BLOCK-1]= '\0';
+
+    if(write(fdToWrite, producedData, BLOCK)== -1)
+        if(errno == EPIPE)
+            errorOccured = -1;
+
+    return errorOccured;
+}
+
+void insertBlockToRing(sharedRing* r, char c)
+{
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned long pos = head % r->capacity;
+    unsigned long first = r->capacity - pos;
+    if(first > BLOCK)
+        first = BLOCK;
+
+    memset(r->data + pos, c, first);
+    memset(r->data, c, BLOCK - first);
+    r->data[(head + BLOCK - 1) % r->capacity] = '\0';
+
+    atomic_store_explicit(&r->head, head + BLOCK, memory_order_release);
+}
+
+/*
+pipe can't be bigger than /proc/sys/fs/pipe-max-size (and pages allowed to user),
+when kernel refuses, storage becomes a ring of the same size
+*/
+void resizePipe(dataContainer* d, int fd[2])
+{
+    if(fcntl(fd[1], F_SETPIPE_SZ, (int)d->storageSize) != -1)
+        return;
+    if(errno != EPERM && errno != EBUSY)
+        errExit("fcntl F_SETPIPE_SZ");
+    printf("pipe can't hold %ld bytes, storage in shared memory ring\n", d->storageSize);
+    close(fd[0]);
+    close(fd[1]);
+    fd[0] = fd[1] = -1;
+    d->useRing = 1;
+}
+
+/*
+capacity is divided between shards; with many of them every one has its own file,
+<path>.0, <path>.1 and so on
+*/
+void createShards(dataContainer* d)
+{
+    unsigned long capacity = (d->storageSize > 0 ? d->storageSize : RINGCAPACITY) / d->numOfGenerators;
+    char path[PATH_MAX];
+    for(int i = 0; i < d->numOfGenerators; i++)
+    {
+        char* p = d->storagePath;
+        if(p != NULL && d->numOfGenerators > 1)
+        {
+            snprintf(path, sizeof(path), "%s.%d", d->storagePath, i);
+            p = path;
+        }
+        d->shards[i] = createRing(capacity, p, d->hugePages, d->localPath != NULL ? &d->ringFds[i] : NULL);
+    }
+    d->ring = d->shards[0];
+}
+
+/*
+ring from file keeps what generator had put there, only parts claimed by clients
+of previous run are given back, they were never finished
+*/
+sharedRing* createRing(unsigned long capacity, const char* path, int huge, int* keepFd)
+{
+    size_t len = sizeof(sharedRing) + capacity;
+    sharedRing* r;
+    if(path == NULL && keepFd == NULL)
+        r = mapRing(len, huge);
+    else if(path == NULL)
+        r = mapMemfd(len, huge, keepFd);
+    else
+    {
+        int fd = open(path, O_RDWR | O_CREAT, 0600);
+        if(fd == -1)
+            errExit("open");
+        struct stat st;
+        if(fstat(fd, &st) == -1)
+            errExit("fstat");
+        if((size_t)st.st_size != len && ftruncate(fd, 0) == -1)   //other size, nothing to reuse
+            errExit("ftruncate");
+        if(ftruncate(fd, len) == -1)
+            errExit("ftruncate");
+        r = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(r == MAP_FAILED)
+            errExit("mmap");
+        if(keepFd != NULL)
+            *keepFd = readOnlyFd(fd);   //local clients map the same file
+        close(fd);
+        if(huge)
+            madvise(r, len, MADV_HUGEPAGE);     //only advice, page cache has huge pages only on some filesystems
+    }
+
+    if(path != NULL && r->magic == RINGMAGIC && r->capacity == capacity)
+    {
+        unsigned long tail = atomic_load(&r->tail);
+        atomic_store(&r->claimed, tail);
+        printf("storage warm started with %lu bytes\n", atomic_load(&r->head) - tail);
+        return r;
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->claimed, 0);
+    r->capacity = capacity;
+    r->magic = RINGMAGIC;
+    return r;
+}
+
+//huge pages have to be reserved by administrator, without them normal pages are used
+void* mapRing(size_t len, int huge)
+{
+    void* r = MAP_FAILED;
+    if(huge)
+    {
+        r = mmap(NULL, (len + HUGEPAGE - 1) & ~(HUGEPAGE - 1), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if(r == MAP_FAILED)
+            printf("no huge pages for storage, using normal ones\n");
+    }
+    if(r == MAP_FAILED)
+        r = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(r == MAP_FAILED)
+        errExit("mmap");
+    return r;
+}
+
+/*
+like mapRing, but pages have descriptor which can be passed to local clients;
+size is sealed and clients get only read only descriptor, so none of them can cut
+storage under producent (access behind the end would kill it with SIGBUS)
+*/
+void* mapMemfd(size_t len, int huge, int* fd)
+{
+    void* r = MAP_FAILED;
+    if(huge && (*fd = memfd_create("producent-storage", MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB)) != -1)
+    {
+        size_t hugeLen = (len + HUGEPAGE - 1) & ~(HUGEPAGE - 1);
+        if(ftruncate(*fd, hugeLen) == 0)
+            r = mmap(NULL, hugeLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, *fd, 0);
+        if(r == MAP_FAILED)
+            close(*fd);
+    }
+    if(huge && r == MAP_FAILED)
+        printf("no huge pages for storage, using normal ones\n");
+    if(r == MAP_FAILED)
+    {
+        if((*fd = memfd_create("producent-storage", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+            errExit("memfd_create");
+        if(ftruncate(*fd, len) == -1)
+            errExit("ftruncate");
+        r = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, *fd, 0);
+    }
+    if(r == MAP_FAILED)
+        errExit("mmap");
+    if(fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+        errExit("fcntl");
+    int rw = *fd;
+    *fd = readOnlyFd(rw);
+    close(rw);
+    return r;
+}
+
+//the same file opened again only for reading, mapping made through it can't write
+int readOnlyFd(int fd)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int ro = open(path, O_RDONLY | O_CLOEXEC);
+    if(ro == -1)
+        errExit("open");
+    return ro;
+}
+
+int storageLevel(dataContainer* d)
+{
+    int str;
+    if(d->sim != NULL)
+        return d->sim->level;
+    if(d->useRing)
+    {
+        str = 0;
+        for(int i = 0; i < d->numOfGenerators; i++)
+            str += (int)(atomic_load_explicit(&d->shards[i]->head, memory_order_acquire) 
+                - atomic_load_explicit(&d->shards[i]->claimed, memory_order_relaxed));
+        return str;
+    }
+
+    if( ioctl(d->toRead, FIONREAD, &str) == -1)
+        errExit("ioctl");
+    return str;
+}
+
+int storageCapacity(dataContainer* d)
+{
+    if(d->sim != NULL)
+        return d->storageSize > 0 ? d->storageSize : RINGCAPACITY;
+    if(d->useRing)
+        return (int)d->ring->capacity * d->numOfGenerators;
+    return fcntl(d->toRead, F_GETPIPE_SZ);
+}
+
+//how much generator can really put into storage
+int storageUsable(dataContainer* d)
+{
+    if(d->sim != NULL)
+        return storageCapacity(d) - BLOCK;
+    if(d->useRing)
+        return storageCapacity(d) - BLOCK * d->numOfGenerators;  //every shard can be short of one block
+    //pipe has a limited number of page slots, partly read and partly written slots waste room
+    int capacity = storageCapacity(d);
+    return capacity - capacity / 4;
+}
+
+void storageDiscard(dataContainer* d, int bytes)
+{
+    if(bytes <= 0)
+        return;
+    if(d->useRing)
+    {
+        while(bytes > 0)
+        {
+            unsigned long start;
+            int len;
+            sharedRing* r = shardClaim(d, bytes, &start, &len);
+            ringRelease(d, r, start, len);
+            bytes -= len;
+        }
+        return;
+    }
+    char* buff = calloc(bytes, sizeof(char));
+    if(read(d->toRead, buff, bytes) == -1)
+        errExit("read");
+    free(buff);
+}
+
+/*
+block of DATABLOCK bytes: 4 bytes of sequence number of block in connection, data from storage,
+4 bytes of CRC32C of everything before, both in network order. konsument -I checks them
+*/
+void sealBlock(char* block, uint32_t seq)
+{
+    uint32_t v = htonl(seq);
+    memcpy(block, &v, sizeof(v));
+    v = htonl(~crc32c(~0U, (unsigned char*)block, DATABLOCK - sizeof(v)));
+    memcpy(block + DATABLOCK - sizeof(v), &v, sizeof(v));
+}
+
+//returns position from which reactor can send bytes
+unsigned long ringClaim(sharedRing* r, int bytes)
+{
+    return atomic_fetch_add_explicit(&r->claimed, bytes, memory_order_relaxed);
+}
+
+/*
+takes up to bytes from shard which has most data. Reserved blocks are counted against
+all shards together, so they are there, but maybe scattered between shards, then
+caller takes them in parts. Returns shard, place of part in it and its length
+*/
+sharedRing* shardClaim(dataContainer* d, int bytes, unsigned long* start, int* len)
+{
+    if(d->numOfGenerators == 1)
+    {
+        *start = ringClaim(d->ring, bytes);
+        *len = bytes;
+        return d->ring;
+    }
+    while(1)
+    {
+        sharedRing* best = NULL;
+        long most = 0;
+        for(int i = 0; i < d->numOfGenerators; i++)
+        {
+            sharedRing* r = d->shards[(d->nextShard + i) % d->numOfGenerators];
+            long level = (long)(atomic_load_explicit(&r->head, memory_order_acquire) 
+                - atomic_load_explicit(&r->claimed, memory_order_relaxed));
+            if(level > most)
+            {
+                most = level;
+                best = r;
+            }
+        }
+        d->nextShard = (d->nextShard + 1) % d->numOfGenerators;
+        if(best == NULL)
+        {
+            sched_yield();  //other reactor took it, its reservation will be given back soon
+            continue;
+        }
+        //other reactors claim from the same shards
+        unsigned long claimed = atomic_load_explicit(&best->claimed, memory_order_relaxed);
+        long level = (long)(atomic_load_explicit(&best->head, memory_order_acquire) - claimed);
+        if(level <= 0)
+            continue;
+        *len = level < bytes ? level : bytes;
+        if(atomic_compare_exchange_weak_explicit(&best->claimed, &claimed, claimed + *len, 
+            memory_order_relaxed, memory_order_relaxed))
+        {
+            *start = claimed;
+            return best;
+        }
+    }
+}
+
+//place is given back to generator in order of claims, with one reactor it never waits
+void ringRelease(dataContainer* d, sharedRing* r, unsigned long start, int bytes)
+{
+    if(d->localHolders > 0)
+    {
+        deferRelease(d, r, start, bytes);
+        return;
+    }
+    while(atomic_load_explicit(&r->tail, memory_order_acquire) != start)
+        sched_yield();
+    atomic_store_explicit(&r->tail, start + bytes, memory_order_release);
+}
+
+/*
+sends bytes from storage to client; from the ring straight out of shared memory, from the pipe with splice()
+when it is enabled, so data never passes through our memory. Whatever socket didn't accept is taken
+out of storage anyway and kept in cd->pending, so blocks of different clients never interleave.
+returns 1 when everything was sent
+*/
+int storageSend(dataContainer* d, clientParameters* cd, int bytes)
+{
+    ssize_t w;
+    if(d->integrity)
+    {
+        //blocks have to be changed, so they always pass through our memory
+        char buff[SENDBATCH * DATABLOCK];
+        storageCopy(d, buff, bytes);
+        for(int off = 0; off < bytes; off += DATABLOCK)
+            sealBlock(buff + off, cd->blockSeq++);
+        if( (w = write(cd->fd, buff, bytes )) == -1)
+        {
+            if(errno != EINTR && errno != EAGAIN)
+                errExit("write");
+            w = 0;
+        }
+        if(w < bytes)
+            stashPending(cd, buff + w, bytes - w);
+        return w == bytes;
     }
-  }
+    if(!d->useRing)
+    {
+        char buff[SENDBATCH * DATABLOCK];
+        int copied = 0;     //beginning of block already taken out of storage into buff
+        if(d->useSplice)
+        {
+            int from = d->toRead;
+            int moved = bytes;
+            if(d->group != NULL)
+            {
+                //whole block in one call, other reactors read the same pipe
+                for(moved = 0; moved < bytes; )
+                {
+                    w = splice(d->toRead, NULL, d->splicePipe[1], NULL, bytes - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    if(w == -1 && errno == EINTR)
+                        continue;
+                    if(w == -1 && errno == EAGAIN)
+                        break;
+                    if(w == -1)
+                        errExit("splice");
+                    moved += w;
+                }
+                from = d->splicePipe[0];
+            }
+            if(moved < bytes)
+            {
+                //pipe between didn't take whole block, it is copied, its beginning from that pipe
+                if(moved > 0 && read(from, buff, moved) == -1)
+                    errExit("read");
+                copied = moved;
+            }
+            else if((w = splice(from, NULL, cd->fd, NULL, bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == -1 && errno == EINVAL)
+            {
+                fprintf(stderr, "splice is not supported for this socket, copying data\n");
+                d->useSplice = 0;
+                if(from != d->toRead && read(from, buff, bytes) == -1)
+                    errExit("read");    //block is already in pipe between
+                copied = from != d->toRead ? bytes : 0;
+            }
+            else if(w == -1 && errno != EINTR && errno != EAGAIN)
+                errExit("splice");
+            else
+            {
+                if(w == -1)
+                    w = 0;
+                if(w == bytes)
+                    return 1;
+                //copy only what is left from the block
+                if(read(from, buff, bytes - w) == -1)
+                    errExit("read");
+                stashPending(cd, buff, bytes - w);
+                return 0;
+            }
+        }
+
+        if(copied < bytes && read(d->toRead, buff + copied, bytes - copied) == -1)
+            errExit("read");
+        if( (w = write(cd->fd, buff, bytes )) == -1)
+        {
+            if(errno != EINTR && errno != EAGAIN)
+                errExit("write");
+            w = 0;
+        }
+        if(w == bytes)
+            return 1;
+        stashPending(cd, buff + w, bytes - w);
+        return 0;
+    }
+
+    //with many shards block can be taken in parts, after first part which socket didn't take all go to pending
+    while(bytes > 0)
+    {
+        unsigned long tail;
+        int len;
+        sharedRing* r = shardClaim(d, bytes, &tail, &len);
+        unsigned long pos = tail % r->capacity;
+        struct iovec iov[2];
+        int iovcnt = 1;
+        iov[0].iov_base = r->data + pos;
+        iov[0].iov_len = len;
+        if(pos + len > r->capacity)
+        {
+            iov[0].iov_len = r->capacity - pos;
+            iov[1].iov_base = r->data;
+            iov[1].iov_len = len - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        w = 0;
+        if(cd->pendingLen == 0 && (w = writev(cd->fd, iov, iovcnt)) == -1)
+        {
+            if(errno != EINTR && errno != EAGAIN)
+                errExit("writev");
+            w = 0;
+        }
+        //rest is copied, because the place in ring has to be returned to generator
+        for(int i = 0; i < iovcnt; i++)
+        {
+            if((size_t)w >= iov[i].iov_len)
+            {
+                w -= iov[i].iov_len;
+                continue;
+            }
+            stashPending(cd, (char*)iov[i].iov_base + w, iov[i].iov_len - w);
+            w = 0;
+        }
+        ringRelease(d, r, tail, len);
+        bytes -= len;
+    }
+    return cd->pendingLen == 0;
 }
 
-float parseFloat(char* arr) 
+//takes bytes out of storage into buff
+void storageCopy(dataContainer* d, char* buff, int bytes)
 {
-    errno = 0;
-    char* eptr;
-    float val = strtof(arr, &eptr);
-    if(*eptr != '\0'|| errno == ERANGE ) 
-        errExit("strtof");
-    return val;
+    if(!d->useRing)
+    {
+        if(read(d->toRead, buff, bytes) == -1)
+            errExit("read");
+        return;
+    }
+    for(int off = 0; off < bytes; )
+    {
+        unsigned long start;
+        int len;
+        sharedRing* r = shardClaim(d, bytes - off, &start, &len);
+        unsigned long pos = start % r->capacity;
+        unsigned long first = r->capacity - pos < (unsigned long)len ? r->capacity - pos : (unsigned long)len;
+        memcpy(buff + off, r->data + pos, first);
+        memcpy(buff + off + first, r->data, len - first);
+        ringRelease(d, r, start, len);
+        off += len;
+    }
+}
+
+//returns 1 when the rest of block reached the client
+int sendPending(clientParameters* cd)
+{
+    ssize_t w = write(cd->fd, cd->pending + cd->pendingOff, cd->pendingLen - cd->pendingOff);
+    if(w == -1)
+    {
+        if(errno != EINTR && errno != EAGAIN)
+            errExit("write");
+        return 0;
+    }
+    cd->pendingOff += w;
+    if(cd->pendingOff < cd->pendingLen)
+        return 0;
+    cd->pendingLen = cd->pendingOff = 0;
+    return 1;
+}
+
+void stashPending(clientParameters* cd, const char* src, int len)
+{
+    if(cd->pendingLen + len > cd->pendingCap)
+    {
+        cd->pendingCap = cd->pendingLen + len;
+        if((cd->pending = realloc(cd->pending, cd->pendingCap)) == NULL)
+            errExit("realloc");
+    }
+    memcpy(cd->pending + cd->pendingLen, src, len);
+    cd->pendingLen += len;
+}
+
+void parseArguments(int argc, char** argv, dataContainer* d)
+{
+  int opt;
+  char* simSpec = NULL;
+  while( (opt=getopt(argc, argv, "p:rzet:EHgvm:l:o:iq:T:D:W:S:Q:R:s:F:UG:IB:ux:A:b:Mj")) != -1 )
+  {
+    switch(opt)
+    {
+      case 'p':
+            d->frequency = parseFloat(optarg);
+            break;
+      case 'r':
+            d->useRing = 1;
+            break;
+      case 'z':
+            d->useSplice = 1;
+            break;
+      case 'e':
+            d->eventDriven = 1;
+            break;
+      case 'E':
+            d->edgeTriggered = 1;
+            break;
+      case 'H':
+            d->negotiate = 1;
+            break;
+      case 'g':
+            d->batchedGenerator = 1;
+            break;
+      case 'v':
+            d->batchedGenerator = 1;
+            d->useVmsplice = 1;
+            break;
+      case 'm':
+            d->metricsPath = optarg;
+            break;
+      case 'l':
+            if(strcmp(optarg, "drop") == 0)
+                d->logOverwrite = 0;
+            else if(strcmp(optarg, "overwrite") == 0)
+                d->logOverwrite = 1;
+            else
+            {
+                printf("log policy has to be drop or overwrite\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+      case 'o':
+            d->logPath = optarg;
+            break;
+      case 'i':
+            d->useUring = 1;
+            break;
+      case 'T':
+            d->idleTimeout = parseInt(optarg);
+            break;
+      case 'D':
+            d->portionTimeout = parseInt(optarg);
+            break;
+      case 'W':
+            d->waitTimeout = parseInt(optarg);
+            break;
+      case 'S':
+            simSpec = optarg;   //default rate is -p, which can come later
+            break;
+      case 's':
+            d->storageSize = parseSize(optarg);
+            if(d->storageSize < DATAPORTION + BLOCK || d->storageSize > MAXSTORAGE)
+            {
+                printf("size of storage has to be between %d and %ld bytes\n", DATAPORTION + BLOCK, MAXSTORAGE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+      case 'F':
+            d->storagePath = optarg;
+            d->useRing = 1;
+            break;
+      case 'U':
+            d->hugePages = 1;
+            d->useRing = 1;
+            break;
+      case 'I':
+            d->integrity = 1;
+            break;
+      case 'u':
+            d->datagrams = 1;
+            break;
+      case 'A':
+            {
+                //reactors/generators, e.g. 2,3/4-7
+                char* gen = strchr(optarg, '/');
+                if(gen != NULL)
+                {
+                    *gen++ = '\0';
+                    d->numOfGeneratorCpus = parseCpus(gen, d->generatorCpus);
+                }
+                d->numOfReactorCpus = parseCpus(optarg, d->reactorCpus);
+            }
+            break;
+      case 'b':
+            d->busyPoll = parseInt(optarg);
+            break;
+      case 'M':
+            d->lockMemory = 1;
+            break;
+      case 'j':
+            d->measureJitter = 1;
+            break;
+      case 'x':
+            d->localPath = optarg;
+            d->useRing = 1;     //pipe can't be shared with clients
+            break;
+      case 'B':
+            d->broadcastLag = parseInt(optarg);
+            if(d->broadcastLag < 1)
+            {
+                printf("lag of broadcast has to be at least 1 block\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+      case 'G':
+            d->numOfGenerators = parseInt(optarg);
+            if(d->numOfGenerators < 1 || d->numOfGenerators > MAXGENERATORS)
+            {
+                printf("number of generators has to be between 1 and %d\n", MAXGENERATORS);
+                exit(EXIT_FAILURE);
+            }
+            if(d->numOfGenerators > 1)
+                d->useRing = 1;     //pipe would be read by reactors as one stream anyway
+            break;
+      case 'Q':
+            d->maxConnections = parseInt(optarg);
+            if(d->maxConnections < 1)
+            {
+                printf("limit of connections has to be positive\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+      case 'R':
+            if(strcmp(optarg, "reject") == 0)
+                d->rejectOverLimit = 1;
+            else if(strcmp(optarg, "backlog") == 0)
+                d->rejectOverLimit = 0;
+            else
+            {
+                printf("over limit policy has to be reject or backlog\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+      case 'q':
+            if(strcmp(optarg, "fifo") == 0)
+                d->policy = POLICY_FIFO;
+            else if(strcmp(optarg, "edf") == 0)
+                d->policy = POLICY_EDF;
+            else if(strcmp(optarg, "lrm") == 0)
+                d->policy = POLICY_LRM;
+            else
+            {
+                printf("policy has to be fifo, edf or lrm\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+      case 't':
+            d->numOfReactors = parseInt(optarg);
+            if(d->numOfReactors < 1 || d->numOfReactors > MAXREACTORS)
+            {
+                printf("number of reactors has to be between 1 and %d\n", MAXREACTORS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+     
+      default:
+            printf("Wrong parameters!\n");
+            exit(EXIT_FAILURE);
+    }
+  }
+  if(d->numOfGenerators > 1 && (d->storageSize > 0 ? d->storageSize : RINGCAPACITY) / d->numOfGenerators < 2 * BLOCK)
+  {
+    printf("every generator needs at least %d bytes of storage\n", 2 * BLOCK);
+    exit(EXIT_FAILURE);
+  }
+  if(simSpec != NULL)
+    d->sim = parseSimulation(simSpec, d->frequency);
+  if(d->useUring && (d->numOfReactors > 1 || d->edgeTriggered || d->negotiate || d->useSplice || deadlinesEnabled(d)))
+  {
+    printf("io_uring backend works with one reactor, without -E, -H, -z and deadlines; using epoll\n");
+    d->useUring = 0;
+  }
+  if(d->useUring && d->integrity && !d->useRing)
+  {
+    printf("io_uring backend sends blocks straight from pipe, -I needs -r there; using epoll\n");
+    d->useUring = 0;
+  }
+  if(d->broadcastLag > 0 && (d->numOfReactors > 1 || d->useUring || d->edgeTriggered))
+  {
+    printf("broadcast stream is kept by one epoll reactor, -t, -i and -E are ignored\n");
+    d->numOfReactors = 1;
+    d->useUring = d->edgeTriggered = 0;
+  }
+  if(d->broadcastLag > 0 && d->integrity && !d->negotiate)
+  {
+    printf("client learns that broadcast numbers blocks in stream only from grant, -I needs -H there; -I is ignored\n");
+    d->integrity = 0;
+  }
+  if(d->datagrams && (d->useUring || d->broadcastLag > 0))
+  {
+    printf("datagrams are served only by epoll reactors without broadcast; -u is ignored\n");
+    d->datagrams = 0;
+  }
+  if(d->localPath != NULL && (d->numOfReactors > 1 || d->useUring || d->edgeTriggered || d->broadcastLag > 0 || d->integrity))
+  {
+    printf("local clients are served by one epoll reactor without -E, -B and -I; -x is ignored\n");
+    d->localPath = NULL;
+  }
+  if(d->integrity && d->useSplice)
+  {
+    printf("blocks with -I are changed before sending, they can't be spliced\n");
+    d->useSplice = 0;
+  }
+  //only requests carry size and deadline, without them every client is the same for edf and lrm
+  if(d->policy != POLICY_FIFO && !d->negotiate && !d->datagrams && d->localPath == NULL && d->sim == NULL)
+  {
+    printf("without -H, -u or -x clients send no requests and every one waits for 4 blocks with no deadline, "
+        "edf and lrm work like fifo; -q is ignored\n");
+    d->policy = POLICY_FIFO;
+  }
 }
 
 void parseAddress(char* arg, dataContainer* d)
@@ -489,6 +4190,31 @@ void parseAddress(char* arg, dataContainer* d)
     }
 }
 
+//bytes, with k, M or G as binary multiples; -1 when it is wrong or bigger than MAXSTORAGE
+long parseSize(char* arr)
+{
+    char* eptr;
+    errno = 0;
+    long val = strtol(arr, &eptr, 10);
+    if(errno != 0 || eptr == arr)
+        errExit("strtol");
+    int shift = 0;
+    if(*eptr == 'k' || *eptr == 'K')
+        shift = 10;
+    else if(*eptr == 'm' || *eptr == 'M')
+        shift = 20;
+    else if(*eptr == 'g' || *eptr == 'G')
+        shift = 30;
+    else if(*eptr != '\0')
+        return -1;
+    if(*eptr != '\0' && eptr[1] != '\0')
+        return -1;
+    //checked before shift, bigger value would overflow
+    if(val < 0 || val > (MAXSTORAGE >> shift))
+        return -1;
+    return val << shift;
+}
+
 int parseInt(char* arr )
 {
     char *eptr;
@@ -500,38 +4226,398 @@ int parseInt(char* arr )
     return val;
 }
 
-//for ring buffer
-void addElem(dataContainer* b, int elem)
+/*
+fifo - order of coming
+edf  - earliest deadline first, deadline is time of coming + deadline from request
+lrm  - least remaining magazine first, client which wants fewest blocks is the closest to full magazine
+*/
+void setPriority(dataContainer* d, clientParameters* cd)
+{
+    cd->seq = d->nextSeq++;
+    cd->priority = 0;
+    if(d->policy == POLICY_EDF)
+        cd->priority = cd->deadlineMs ? (d->sim != NULL ? d->sim->now : nowUs()) + cd->deadlineMs * 1000UL : ULONG_MAX;
+    else if(d->policy == POLICY_LRM)
+        cd->priority = cd->numOfRequestedBlocks;
+}
+
+int goesBefore(clientParameters* a, clientParameters* b)
+{
+    if(a->priority != b->priority)
+        return a->priority < b->priority;
+    return a->seq < b->seq;
+}
+
+//for wait queue, binary heap in array, every client knows its place in it
+void addElem(dataContainer* b, clientParameters* elem)
+{
+    if(b->size == b->queueCap)
+    {
+        clientParameters** q = realloc(b->waitQueue, 2 * b->queueCap * sizeof(clientParameters*));
+        if(q == NULL)
+            errExit("realloc");
+        b->waitQueue = q;
+        b->queueCap *= 2;
+    }
+    b->waitQueue[b->size] = elem;
+    elem->queueIndex = b->size++;
+    siftUp(b, elem->queueIndex);
+}
+
+clientParameters* removeFirstElem(dataContainer* b)
+{
+    return removeElem(b, 0);
+}
+
+//any client, e.g. the one which waited too long
+clientParameters* removeElem(dataContainer* b, int i)
+{
+    clientParameters* elem = b->waitQueue[i];
+    clientParameters* last = b->waitQueue[--b->size];
+    b->waitQueue[b->size] = NULL;
+    elem->queueIndex = -1;
+    if(elem != last)
+    {
+        b->waitQueue[i] = last;
+        last->queueIndex = i;
+        siftUp(b, i);
+        siftDown(b, last->queueIndex);
+    }
+    return elem;
+}
+
+void siftUp(dataContainer* b, int i)
+{
+    clientParameters* elem = b->waitQueue[i];
+    while(i > 0 && goesBefore(elem, b->waitQueue[(i - 1) / 2]))
+    {
+        b->waitQueue[i] = b->waitQueue[(i - 1) / 2];
+        b->waitQueue[i]->queueIndex = i;
+        i = (i - 1) / 2;
+    }
+    b->waitQueue[i] = elem;
+    elem->queueIndex = i;
+}
+
+void siftDown(dataContainer* b, int i)
+{
+    clientParameters* elem = b->waitQueue[i];
+    while(2 * i + 1 < b->size)
+    {
+        int child = 2 * i + 1;
+        if(child + 1 < b->size && goesBefore(b->waitQueue[child + 1], b->waitQueue[child]))
+            child++;
+        if(!goesBefore(b->waitQueue[child], elem))
+            break;
+        b->waitQueue[i] = b->waitQueue[child];
+        b->waitQueue[i]->queueIndex = i;
+        i = child;
+    }
+    b->waitQueue[i] = elem;
+    elem->queueIndex = i;
+}
+
+clientParameters* firstElem(dataContainer* b)
+{
+    return b->waitQueue[0];
+}
+
+clientParameters* draw(dataContainer b, int e)
+{
+    if(e < b.size)
+        return b.waitQueue[e];
+    return NULL;
+}
+
+/*
+discrete-event simulation: the same wait queue and admission as real server, but storage is a number,
+consumers follow model of konsument (-L mode) and time is virtual, so hours pass in a moment.
+Portion leaves storage at admission, socket buffers of loopback hold more than largest portion
+*/
+void runSimulation(dataContainer* d)
+{
+    simulation* s = d->sim;
+    d->eventDriven = 0;
+    d->numOfReactors = 1;
+    createClientStructures(d);
+
+    int idx[SIMKEYS] = {0};
+    printf("clients rate consumption degradation capacity | portions degradation[B] never served | "
+        "storage full[%%] | wait p50 p90 p99 max [ms] | completion p50 p90 max [ms]\n");
+    while(1)
+    {
+        simulateOne(d, idx);
+        //next combination of swept values, the last key changes first
+        int k = SIMKEYS - 1;
+        while(k >= 0 && ++idx[k] == s->count[k])
+            idx[k--] = 0;
+        if(k < 0)
+            break;
+    }
+}
+
+void simulateOne(dataContainer* d, int* idx)
 {
-    if(b->size == MAXCLIENTS)
+    simulation* s = d->sim;
+    int clients = parseInt(s->values[SIM_CLIENTS][idx[SIM_CLIENTS]]);
+    float rate = parseFloat(s->values[SIM_RATE][idx[SIM_RATE]]);
+    distribution consumption, degradation, capacity;
+    parseDistribution(s->values[SIM_CONSUMPTION][idx[SIM_CONSUMPTION]], &consumption);
+    parseDistribution(s->values[SIM_DEGRADATION][idx[SIM_DEGRADATION]], &degradation);
+    parseDistribution(s->values[SIM_CAPACITY][idx[SIM_CAPACITY]], &capacity);
+    if(clients < 1 || rate <= 0)
     {
-        printf("ring buffer is full\n");
+        printf("simulation needs at least 1 client and positive rate\n");
         exit(EXIT_FAILURE);
     }
-    if( b->ringBuffer[b->lastUsed] == 0)
+
+    srand48(s->seed);   //every combination sees the same draws
+    s->now = s->level = s->full = s->numOfEvents = s->nextEvent = 0;
+    s->waits.len = s->completions.len = 0;
+    s->portions = s->degradationBytes = 0;
+    s->consumers = realloc(s->consumers, clients * sizeof(virtualConsumer));
+    if(s->consumers == NULL)
+        errExit("realloc");
+    s->active = 0;
+    for(int i = 0; i < clients; i++)
+    {
+        virtualConsumer* c = &s->consumers[i];
+        memset(c, 0, sizeof(virtualConsumer));
+        c->consumption = drawValue(&consumption);
+        c->degradation = drawValue(&degradation);
+        c->freeSpace = (int)(drawValue(&capacity) + 0.5) * MAGAZINE;
+        if(c->freeSpace > DATAPORTION)
+        {
+            s->active++;
+            simSchedule(s, s->startUs, SIM_CONNECT, i);
+        }
+    }
+    unsigned long tick = (unsigned long)(1e6 * BLOCK / (RATE * rate));
+    simSchedule(s, 0, SIM_PRODUCE, 0);
+
+    while(s->numOfEvents > 0 && s->active > 0)
     {
-        b->ringBuffer[b->lastUsed] = elem;
-        if(b->lastUsed+1< MAXCLIENTS)
-            b->lastUsed++;
-        else b->lastUsed =0;
-        b->size++;
+        simEvent e = simNext(s);
+        if(e.at > s->endUs)
+            break;
+        s->now = e.at;
+        if(e.type == SIM_PRODUCE)
+        {
+            //generator skips its tick when block doesn't fit, as child does
+            if(storageCapacity(d) - s->level >= BLOCK)
+                s->level += BLOCK;
+            else
+                s->full++;
+            simSchedule(s, s->now + tick, SIM_PRODUCE, 0);
+        }
+        else if(e.type == SIM_CONNECT)
+            simConnect(d, e.id);
+        else
+            simConsumed(d, e.id);
+        admitWaitingClients(d);
     }
-   
+
+    int neverServed = 0;
+    for(int i = 0; i < clients; i++)
+        if(s->consumers[i].freeSpace > DATAPORTION && s->consumers[i].portions == 0)
+            neverServed++;
+    //clients still waiting go back to pool, next combination starts with empty queue
+    while(d->size > 0)
+        freeClient(d, removeFirstElem(d));
+    d->numOfClients = 0;
+    d->numOfBlocks = 0;
+
+    unsigned long ticks = s->now / tick + 1;
+    printf("%7d %4.2f %11s %11s %8s | %8lu %15lu %12d | %15.2f | %8.1f %5.1f %5.1f %6.1f | %10.1f %5.1f %6.1f\n",
+        clients, rate, s->values[SIM_CONSUMPTION][idx[SIM_CONSUMPTION]], s->values[SIM_DEGRADATION][idx[SIM_DEGRADATION]],
+        s->values[SIM_CAPACITY][idx[SIM_CAPACITY]], s->portions, s->degradationBytes, neverServed,
+        100.0 * s->full / ticks,
+        samplePercentile(&s->waits, 0.5) / 1e3, samplePercentile(&s->waits, 0.9) / 1e3,
+        samplePercentile(&s->waits, 0.99) / 1e3, samplePercentile(&s->waits, 1) / 1e3,
+        samplePercentile(&s->completions, 0.5) / 1e3, samplePercentile(&s->completions, 0.9) / 1e3,
+        samplePercentile(&s->completions, 1) / 1e3);
 }
-int removeFirstElem(dataContainer* b)
+
+//consumer asks for portion, the server side is the same as after accept (or after header with -H)
+void simConnect(dataContainer* d, int id)
 {
-    int elem =  b->ringBuffer[b->firstUsed];
-    b->ringBuffer[b->firstUsed]=0;
-    if(b->firstUsed+1<MAXCLIENTS)
-       b->firstUsed++;
-    else b->firstUsed=0;
-    b->size--;
-    return elem;
+    simulation* s = d->sim;
+    virtualConsumer* c = &s->consumers[id];
+    clientParameters* cd = allocClient(d);
+    cd->fd = id;    //virtual client has no socket, it keeps index of its consumer
+    cd->numOfRequestedBlocks = 4;
+    if(d->negotiate)
+    {
+        int blocks = c->freeSpace / DATABLOCK;
+        int maxBlocks = (storageUsable(d) - 1) / DATABLOCK;
+        cd->numOfRequestedBlocks = blocks < maxBlocks ? blocks : maxBlocks;
+    }
+    //the same deadline as konsument sends
+    cd->deadlineMs = c->degradation > 0 ? (uint32_t)(1000.0 * DATABLOCK / (DEGRADATION_TIME * c->degradation)) : 0;
+    c->connectUs = s->now;
+    placeClientInRingBuffOrEpoll(d, cd);
+}
+
+//called from admitClient instead of sending
+void simAdmitted(dataContainer* d, clientParameters* cd)
+{
+    simulation* s = d->sim;
+    virtualConsumer* c = &s->consumers[cd->fd];
+    s->level -= cd->numOfRequestedBlocks * DATABLOCK;
+    d->numOfBlocks -= cd->numOfRequestedBlocks;
+    d->numOfClients--;
+    c->blocks = cd->numOfRequestedBlocks;
+    c->firstUs = s->now;
+    sampleAdd(&s->waits, s->now - c->connectUs);
+    //konsument sleeps after every block, last one arrives before the last sleep
+    double times = DATABLOCK / (CONSUMPTION_TIME * c->consumption);
+    sampleAdd(&s->completions, s->now - c->connectUs + (unsigned long)((c->blocks - 1) * times * 1e6));
+    simSchedule(s, s->now + (unsigned long)(c->blocks * times * 1e6), SIM_CONSUMED, cd->fd);
+    freeClient(d, cd);
+}
+
+//the same degradation as in konsument, whole seconds of waiting and receiving
+void simConsumed(dataContainer* d, int id)
+{
+    simulation* s = d->sim;
+    virtualConsumer* c = &s->consumers[id];
+    int deg = (int)((s->now - c->firstUs) / 1000000);
+    int deg2 = (int)((c->firstUs - c->connectUs) / 1000000);
+    int degradation = (int)(deg * DEGRADATION_TIME * c->degradation) + (int)(deg2 * DEGRADATION_TIME * c->degradation);
+    c->freeSpace += degradation - c->blocks * DATABLOCK;
+    s->degradationBytes += degradation;
+    s->portions++;
+    c->portions++;
+    if(c->freeSpace > DATAPORTION)
+        simConnect(d, id);
+    else
+        s->active--;
+}
+
+//events with equal time keep order of scheduling
+void simSchedule(simulation* s, unsigned long at, int type, int id)
+{
+    if(s->numOfEvents == s->eventsCap)
+    {
+        s->eventsCap = s->eventsCap ? 2 * s->eventsCap : 1024;
+        if((s->events = realloc(s->events, s->eventsCap * sizeof(simEvent))) == NULL)
+            errExit("realloc");
+    }
+    simEvent e = { at, s->nextEvent++, type, id };
+    int i = s->numOfEvents++;
+    while(i > 0 && simBefore(&e, &s->events[(i - 1) / 2]))
+    {
+        s->events[i] = s->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->events[i] = e;
+}
+
+simEvent simNext(simulation* s)
+{
+    simEvent first = s->events[0];
+    simEvent last = s->events[--s->numOfEvents];
+    int i = 0;
+    while(2 * i + 1 < s->numOfEvents)
+    {
+        int child = 2 * i + 1;
+        if(child + 1 < s->numOfEvents && simBefore(&s->events[child + 1], &s->events[child]))
+            child++;
+        if(!simBefore(&s->events[child], &last))
+            break;
+        s->events[i] = s->events[child];
+        i = child;
+    }
+    s->events[i] = last;
+    return first;
+}
+
+int simBefore(simEvent* a, simEvent* b)
+{
+    if(a->at != b->at)
+        return a->at < b->at;
+    return a->seq < b->seq;
+}
+
+void sampleAdd(sampleSet* set, unsigned long value)
+{
+    if(set->len == set->cap)
+    {
+        set->cap = set->cap ? 2 * set->cap : 1024;
+        if((set->values = realloc(set->values, set->cap * sizeof(unsigned long))) == NULL)
+            errExit("realloc");
+    }
+    set->values[set->len++] = value;
+}
+
+//exact, samples of one run are sorted in place
+unsigned long samplePercentile(sampleSet* set, double p)
+{
+    if(set->len == 0)
+        return 0;
+    qsort(set->values, set->len, sizeof(unsigned long), compareSamples);
+    int i = (int)(p * set->len);
+    return set->values[i < set->len ? i : set->len - 1];
 }
 
-int draw(dataContainer b, int e)
+/*
+space separated key=value, every value can be a list of alternatives separated by '/', all combinations are run:
+clients=N, rate=-p of producer, consumption, degradation, capacity as -p, -d, -c of konsument -L,
+time=virtual seconds, start=seconds before consumers come, seed=N
+*/
+simulation* parseSimulation(char* arg, float rate)
 {
-    if(e<MAXCLIENTS)
-        return b.ringBuffer[e];
-    return -1;
+    static char* keys[SIMKEYS] = { "clients", "rate", "consumption", "degradation", "capacity" };
+    simulation* s = calloc(1, sizeof(simulation));
+    if(s == NULL)
+        errExit("calloc");
+    static char defaultRate[32];
+    snprintf(defaultRate, sizeof(defaultRate), "%g", rate > 0 ? rate : 1);
+    char* defaults[SIMKEYS] = { "10", defaultRate, "1", "1", "1" };
+    s->endUs = 3600 * 1000000UL;
+    s->seed = 1;
+
+    char* save;
+    for(char* tok = strtok_r(arg, " ", &save); tok != NULL; tok = strtok_r(NULL, " ", &save))
+    {
+        char* value = strchr(tok, '=');
+        if(value == NULL)
+        {
+            printf("simulation parameter has to be key=value\n");
+            exit(EXIT_FAILURE);
+        }
+        *value++ = '\0';
+        if(strcmp(tok, "time") == 0)
+        {
+            s->endUs = (unsigned long)(parseFloat(value) * 1e6);
+            continue;
+        }
+        if(strcmp(tok, "start") == 0)
+        {
+            s->startUs = (unsigned long)(parseFloat(value) * 1e6);
+            continue;
+        }
+        if(strcmp(tok, "seed") == 0)
+        {
+            s->seed = parseInt(value);
+            continue;
+        }
+        int k = 0;
+        while(k < SIMKEYS && strcmp(tok, keys[k]) != 0)
+            k++;
+        if(k == SIMKEYS)
+        {
+            printf("unknown simulation parameter %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+        char* save2;
+        s->count[k] = 0;
+        for(char* v = strtok_r(value, "/", &save2); v != NULL && s->count[k] < MAXSWEEP; v = strtok_r(NULL, "/", &save2))
+            s->values[k][s->count[k]++] = v;
+    }
+    for(int k = 0; k < SIMKEYS; k++)
+        if(s->count[k] == 0)
+            s->values[k][s->count[k]++] = defaults[k];
+    return s;
 }
+